@@ -37,17 +37,59 @@
 #define RST P1_4
 #define RST_BIT BIT4
 
+// Build with make GANG=1 to program up to 4 targets in lockstep. DC and
+// RESET are shared, each target has its own DD: P1_6, P1_7, P1_3, P1_2.
+#ifdef GANG
+#define GANG_TARGETS 4
+#define GANG_DD_MASK (BIT6 | BIT7 | BIT3 | BIT2)
+#endif
+
+// Build with make USART_SPI=1 to shift bytes out to the target with
+// USART1 in SPI master mode. Its alternative 2 pins put SCK on DC and MOSI
+// on DD, which are only handed back to the port for receiving.
+// SPI_BAUD_E sets DC to F / 2^(20 - SPI_BAUD_E). The default is the
+// USART's F / 8 master limit, 3.25MHz at 26MHz, above what bit-banging
+// reaches. Lower it (eg. 16 for 1.6MHz) for long wires to the target.
+#ifdef USART_SPI
+#ifdef GANG
+#error USART_SPI drives a single DD line, it cannot be used with GANG
+#endif
+#ifndef SPI_BAUD_E
+#define SPI_BAUD_E 17
+#endif
+#if SPI_BAUD_E > 17
+#error SPI_BAUD_E above 17 is faster than the USART's F / 8 master limit
+#endif
+#endif
+
 #define RXFIFO_ELEMENTS 2048
 #define RXFIFO_SIZE (RXFIFO_ELEMENTS - 1)
 static __xdata uint8_t rxfifo[RXFIFO_SIZE];
 static uint8_t rxfifo_in;
 static uint8_t rxfifo_out;
 static const __code uint8_t * __at (0x0000) flashp;
-__xdata uint8_t rambuf[1024];
 static uint8_t page;
+static uint8_t tx_busy;
+#ifndef GANG
+static uint8_t timed_out;       // the target did not answer the last wait
+#endif
+
+void cons_putc(uint8_t ch);
+uint8_t cons_getch(void);
 
 static const char banner[] = {'\r', '\n', 'C', 'C', 'H', 'L', '\r', '\n'};
 
+// Reported to cctl-prog in reply to 'i', older builds do not answer
+#define CAP_PAGE_ERASE 0x01
+#define CAP_CRC 0x02
+#define CAP_MULTI_PAGE 0x08
+#ifdef GANG
+#define CAP_GANG 0x04
+#else
+#define CAP_GANG 0
+#endif
+#define CCHL_CAPS (CAP_PAGE_ERASE | CAP_CRC | CAP_GANG | CAP_MULTI_PAGE)
+
 
 #define BIT0 1
 #define BIT1 2
@@ -69,9 +111,24 @@ static const char banner[] = {'\r', '\n', 'C', 'C', 'H', 'L', '\r', '\n'};
 #define ST_STACK_OVERFLOW    0x01
 
 #define FLASHPAGE_SIZE       1024
+#define FLASH_PAGES            32
 #define FLASH_WORD_SIZE         2
 #define WORDS_PER_FLASH_PAGE  512
 
+// Target RAM layout. Up to MAX_PAGES pages are streamed to PAGE_ADDR as
+// they arrive, the flash routine stays loaded at FLASH_PROC_ADDR, and the
+// erase and CRC routines are loaded at PROC_ADDR when they are needed.
+#define PAGE_ADDR            0xF000
+#define MAX_PAGES            3
+
+// Status reads before giving up on a target, each takes several us so
+// this is well over a chip erase or a 3 page write
+#define STATUS_POLLS     50000
+#define FLASH_PROC_ADDR      0xFC00
+#define PROC_ADDR            0xFD00
+#define FLASH_DMA_ADDR       0xFE00
+#define BURST_DMA_ADDR       0xFE08
+
 #define nop()   __asm nop __endasm;
 
 void delay (unsigned char n)
@@ -86,45 +143,212 @@ void delay (unsigned char n)
                 nop();
 }
 
-static void send_byte(uint8_t ch)
+#ifdef GANG
+static const __code uint8_t gang_dd[GANG_TARGETS] = { BIT6, BIT7, BIT3, BIT2 };
+static __idata uint8_t gang_samples[8];     // P1 as each bit was clocked in
+static uint16_t gang_crc[GANG_TARGETS];
+static uint8_t gang_failed;     // targets which timed out, bit each
+
+// Every DD line is driven with the same bit in one port write, and all of
+// them are sampled together in one port read. Port masks must match
+// GANG_DD_MASK.
+static void send_byte(uint8_t ch) __naked
+{
+    ch;     // in dpl
+    __asm
+        mov a, dpl
+        mov r7, #8
+    00001$:
+        rlc a
+        jc 00002$
+        anl _P1, #0x33
+        sjmp 00003$
+    00002$:
+        orl _P1, #0xCC
+    00003$:
+        setb _P1_5
+        clr _P1_5
+        djnz r7, 00001$
+        ret
+    __endasm;
+}
+
+static void gang_sample(void) __naked
+{
+    __asm
+        anl _P1DIR, #0x33       ; DD lines input
+        mov r0, #_gang_samples
+        mov r7, #8
+    00001$:
+        setb _P1_5
+        mov a, _P1
+        clr _P1_5
+        mov @r0, a
+        inc r0
+        djnz r7, 00001$
+        orl _P1DIR, #0xCC       ; back to output
+        ret
+    __endasm;
+}
+
+// The byte one target sent in the last recv_byte()
+static uint8_t gang_byte(uint8_t dd_bit)
 {
-    int8_t i;
-    P1DIR |= DD_BIT; // output
+    uint8_t ch = 0;
+    uint8_t i;
 
-    for (i = 7; i >= 0; i--)
+    for (i = 0; i < 8; i++)
     {
-        if (ch & (1 << i))
-            DD = 1;
-        else
-            DD = 0;
-        DC = 1;
-        DC = 0;
+        ch <<= 1;
+        if (gang_samples[i] & dd_bit)
+            ch |= 1;
     }
+    return ch;
 }
 
+// Returns what the first target sent, the others are in gang_samples
 static uint8_t recv_byte(void)
 {
-    uint8_t ch = 0;
-    int8_t i;
-
-    P1DIR &= ~DD_BIT; // input
+    gang_sample();
+    return gang_byte(DD_BIT);
+}
+#else
+#ifdef USART_SPI
+static uint8_t spi_pending;
 
-    for (i = 7; i >= 0; i--)
+// Waits for the last byte to be shifted out
+static void spi_flush(void)
+{
+    if (spi_pending)
     {
-        DC = 1;
-        if (DD)
-            ch |= (1 << i);
-        DC = 0;
+        while (!(U1CSR & U1CSR_TX_BYTE));
+        U1CSR &= ~U1CSR_TX_BYTE;
+        spi_pending = 0;
     }
-    return ch;
 }
 
+// Returns while the byte is still being shifted out, and only waits for
+// the one before it
+static void send_byte(uint8_t ch)
+{
+    if (spi_pending)
+        spi_flush();
+    else
+        P1SEL |= DC_BIT | DD_BIT;       // DC and DD to USART1
+    U1DBUF = ch;
+    spi_pending = 1;
+}
+
+// Gives DC and DD back to the port for recv_byte()
+static void spi_release(void)
+{
+    spi_flush();
+    P1SEL &= ~(DC_BIT | DD_BIT);
+}
+#else
+// The bit-bang kernels are unrolled assembly: each bit is shifted through
+// carry straight onto DD, and DC is pulsed with bit instructions. DD is
+// left as an output between bytes, recv_byte() only turns it round for
+// the bits it reads. Bit addresses must match DD and DC above.
+static void send_byte(uint8_t ch) __naked
+{
+    ch;     // in dpl
+    __asm
+        mov a, dpl
+        rlc a
+        mov _P1_6, c
+        setb _P1_5
+        clr _P1_5
+        rlc a
+        mov _P1_6, c
+        setb _P1_5
+        clr _P1_5
+        rlc a
+        mov _P1_6, c
+        setb _P1_5
+        clr _P1_5
+        rlc a
+        mov _P1_6, c
+        setb _P1_5
+        clr _P1_5
+        rlc a
+        mov _P1_6, c
+        setb _P1_5
+        clr _P1_5
+        rlc a
+        mov _P1_6, c
+        setb _P1_5
+        clr _P1_5
+        rlc a
+        mov _P1_6, c
+        setb _P1_5
+        clr _P1_5
+        rlc a
+        mov _P1_6, c
+        setb _P1_5
+        clr _P1_5
+        ret
+    __endasm;
+}
+
+#endif
+
+static uint8_t recv_byte(void) __naked
+{
+    __asm
+#ifdef USART_SPI
+        lcall _spi_release
+#endif
+        anl _P1DIR, #0xBF       ; DD input
+        setb _P1_5
+        mov c, _P1_6
+        clr _P1_5
+        rlc a
+        setb _P1_5
+        mov c, _P1_6
+        clr _P1_5
+        rlc a
+        setb _P1_5
+        mov c, _P1_6
+        clr _P1_5
+        rlc a
+        setb _P1_5
+        mov c, _P1_6
+        clr _P1_5
+        rlc a
+        setb _P1_5
+        mov c, _P1_6
+        clr _P1_5
+        rlc a
+        setb _P1_5
+        mov c, _P1_6
+        clr _P1_5
+        rlc a
+        setb _P1_5
+        mov c, _P1_6
+        clr _P1_5
+        rlc a
+        setb _P1_5
+        mov c, _P1_6
+        clr _P1_5
+        rlc a
+        orl _P1DIR, #0x40       ; DD back to output
+        mov dpl, a
+        ret
+    __endasm;
+}
+#endif
+
 
 static void dbg_init(void)
 {
     P1DIR |= RST_BIT;
     P1DIR |= DC_BIT;  // DC
+#ifdef GANG
+    P1DIR |= GANG_DD_MASK;
+#else
     P1DIR |= DD_BIT;  // DD
+#endif
     DD = 0;
 
     // send debug init sequence
@@ -142,6 +366,14 @@ static void dbg_init(void)
     delay(1);
     RST = 1;
     delay(1);
+
+#ifdef USART_SPI
+    U1CSR = 0;                              // SPI master
+    // MSB first, DD changes on rising DC and the target samples it on
+    // falling DC
+    U1GCR = U1GCR_CPHA | U1GCR_ORDER | SPI_BAUD_E;
+    U1BAUD = 0;
+#endif
 }
 
 static uint8_t read_status(void)
@@ -150,11 +382,46 @@ static uint8_t read_status(void)
     return recv_byte();
 }
 
+// Wait until every target reports the status bit, for at most
+// STATUS_POLLS reads. A missing target's DD is pulled up, so it never
+// holds up the others. A target which times out is failed, and is not
+// waited for again.
+static void wait_status(uint8_t bit)
+{
+    uint16_t n = STATUS_POLLS;
+#ifdef GANG
+    uint8_t t;
+    uint8_t waiting;
+
+    do
+    {
+        read_status();
+        waiting = 0;
+        for (t = 0; t < GANG_TARGETS; t++)
+        {
+            if (!(gang_failed & (1 << t)) && !(gang_byte(gang_dd[t]) & bit))
+                waiting |= 1 << t;
+        }
+    }
+    while (waiting && --n);
+    gang_failed |= waiting;
+#else
+    while (!(read_status() & bit))
+    {
+        if (--n == 0)
+        {
+            timed_out = 1;
+            break;
+        }
+    }
+#endif
+}
+
 static void dbg_mass_erase(void)
 {
     send_byte(0x14);
     recv_byte();
-    while (!(read_status() & ST_CHIP_ERASE_DONE));
+    wait_status(ST_CHIP_ERASE_DONE);
 }
 
 static uint8_t debug_instr_1(uint8_t in0)
@@ -192,6 +459,36 @@ static void write_xdata_memory(uint16_t address, uint16_t count, const __xdata u
     }
 }
 
+// Target DMA channel 0 descriptor which moves BURST_WRITE data from
+// DBGDATA (0x6260) into xdata, written to the target at BURST_DMA_ADDR
+static __xdata uint8_t burst_dma[] =
+{
+    0x62, 0x60,     // src DBGDATA
+    0x00, 0x00,     // dst
+    0x00, 0x00,     // len
+    31,             // single byte transfers, DBG_BW trigger
+    0x12            // dst increment, high priority
+};
+
+// Starts a BURST_WRITE of up to 2048 bytes, 1 byte on the wire for each
+// instead of 8 for the MOVX sequence in write_xdata_memory(). The caller
+// sends the data with send_byte() and then reads the status with
+// recv_byte(), so it can be forwarded as it arrives.
+static void burst_begin(uint16_t address, uint16_t count)
+{
+    burst_dma[2] = address >> 8;
+    burst_dma[3] = address;
+    burst_dma[4] = count >> 8;
+    burst_dma[5] = count;
+    write_xdata_memory(BURST_DMA_ADDR, sizeof(burst_dma), burst_dma);
+    debug_instr_3(0x75, 0xD5, BURST_DMA_ADDR >> 8);     // DMA0CFGH
+    debug_instr_3(0x75, 0xD4, BURST_DMA_ADDR & 0xFF);   // DMA0CFGL
+    debug_instr_3(0x75, 0xD6, 0x01);                    // DMAARM channel 0
+
+    send_byte(0x80 | ((count >> 8) & 0x07));
+    send_byte(count);
+}
+
 static void set_pc(uint16_t address)
 {
     debug_instr_3(0x02,address >> 8,address);
@@ -205,10 +502,11 @@ static void cpu_resume(void)
 
 
 
+// Each byte goes to the UART as soon as it is read, cons_putc() only
+// waits for the one before it, so the next read overlaps the transmit
 static void read_code_memory(uint16_t address, 
                       uint8_t  bank, 
-                      uint16_t count, 
-                      __xdata uint8_t *outputData)
+                      uint16_t count)
 {
     int i;
     if (address >= 0x8000)
@@ -218,68 +516,182 @@ static void read_code_memory(uint16_t address,
     debug_instr_3(0x90,address >> 8,address);
     for (i = 0; i < count; ++i) {
         debug_instr_1(0xE4);
-        outputData[i] = debug_instr_1(0x93);
+        cons_putc(debug_instr_1(0x93));
         debug_instr_1(0xA3);
     }
 }
 
-static __xdata uint8_t updProc[] =
-{ 
+// Target DMA channel 0 descriptor which feeds a page to FWDATA (0xDFAF)
+// for the flash controller, the source page is set by flashProc
+static __xdata uint8_t flash_dma[] =
+{
+    0xF0, 0x00,     // src
+    0xDF, 0xAF,     // dst FWDATA
+    FLASHPAGE_SIZE >> 8, FLASHPAGE_SIZE & 0xFF,
+    18,             // single byte transfers, FLASH trigger
+    0x42            // src increment, high priority
+};
+
+// Erases and writes R7 pages, starting with FADDRH R6 from the buffer at
+// R5 << 8. Each page is written by DMA, the CPU only waits for it.
+static __xdata uint8_t flashProc[] =
+{
+    0x75, 0xAB, 0x23,                       // FWT
+    0x75, 0xD5, FLASH_DMA_ADDR >> 8,        // DMA0CFGH
+    0x75, 0xD4, FLASH_DMA_ADDR & 0xFF,      // DMA0CFGL
+    0x8E, 0xAD,                             // FADDRH = R6
+    0x75, 0xAC, 0x00,                       // FADDRL = 0
+    0x75, 0xAE, 0x01, // ------
+    0xE5, 0xAE,       // erase page
+    0x20, 0xE7, 0xFB, // ------
+    0x90, FLASH_DMA_ADDR >> 8, FLASH_DMA_ADDR & 0xFF,
+    0xED,                                   // src high = R5
+    0xF0,
+    0x53, 0xD1, 0xFE,                       // clear DMAIF0
+    0x75, 0xD6, 0x01,                       // arm channel 0
+    0x75, 0xAE, 0x02, // ------
+    0xE5, 0xD1,       // write page
+    0x30, 0xE0, 0xFB, // until DMA done
+    0xE5, 0xAE,       // and flash
+    0x20, 0xE7, 0xFB, // not busy
+    0x0E, 0x0E,                             // R6 += 2
+    0xED, 0x24, 0x04, 0xFD,                 // R5 += 4
+    0xDF, 0xD3,                             // next page
+    0xA5
+};
+static uint8_t flash_proc_loaded;
+
+
+static __xdata uint8_t eraseProc[] =
+{
     0x75, 0xAD, /*ADDRESS*/0x00,
-    0x75, 0xAC, 0x00, 
-    0x75, 0xAB, 0x23, 0x00,
+    0x75, 0xAC, 0x00,
+    0x75, 0xAB, 0x23,
     0x75, 0xAE, 0x01, // ------
     0xE5, 0xAE,       // erase code
     0x20, 0xE7, 0xFB, // ------
-    0x90, 0xF0, 0x00,
-    0x7F, WORDS_PER_FLASH_PAGE >> 8,
-    0x7E, WORDS_PER_FLASH_PAGE & 0xFF,
-    0x75, 0xAE, 0x02,
-    0x7D, FLASH_WORD_SIZE,
-    0xE0, 
-    0xA3, 
-    0xF5, 0xAF,
-    0xDD, 0xFA,
-    0xE5, 0xAE,
-    0x20, 0xE6, 0xFB,
-    0xDE, 0xF1,
-    0xDF, 0xEF,
     0xA5
 };
 
+// Erase one page by running the flash controller from the target's CPU,
+// the debug interface itself can only erase the whole chip
+static void erase_flash_page(uint32_t address)
+{
+    eraseProc[2] = ((address >> 8) / FLASH_WORD_SIZE) & 0x7E;
+
+    write_xdata_memory(PROC_ADDR, sizeof(eraseProc), eraseProc);
+    debug_instr_3(0x75,0xC7,0x51);
+    set_pc(PROC_ADDR);
+    cpu_resume();
+    wait_status(ST_CPU_HALTED);
+}
+
+static __xdata uint8_t crcProc[] =
+{
+    0x75, 0xBC, 0xFF,       // RNDL = 0xFF twice, seeds the CRC with 0xFFFF
+    0x75, 0xBC, 0xFF,
+    0x90, /*ADDRESS*/0x00, 0x00,
+    0x7F, /*BLOCKS*/0x00,   // of 256 bytes
+    0x7E, 0x00,
+    0xE4,                   // ------
+    0x93,                   // RNDH = code[dptr++]
+    0xF5, 0xBD,
+    0xA3,                   // ------
+    0xDE, 0xF9,
+    0xDF, 0xF7,
+    0xA5
+};
 
-static void write_flash_page(uint32_t address)
+// CRC16 of count pages from first, calculated by the slave's own CRC
+// hardware so only the result crosses the debug interface
+static uint16_t crc_flash(uint8_t first, uint8_t count)
 {
-    uint8_t updProcSize = sizeof(updProc);
+    uint16_t crc;
+#ifdef GANG
+    uint8_t n;
+#endif
 
-    updProc[2] = ((address >> 8) / FLASH_WORD_SIZE) & 0x7E;
+    crcProc[7] = first << 2;
+    crcProc[10] = count << 2;
 
-    write_xdata_memory(0xF000,  FLASHPAGE_SIZE, rambuf);
-    write_xdata_memory(0xF000 + FLASHPAGE_SIZE, updProcSize, updProc);
+    write_xdata_memory(PROC_ADDR, sizeof(crcProc), crcProc);
     debug_instr_3(0x75,0xC7,0x51);
-    set_pc(0xF000 + FLASHPAGE_SIZE);
+    set_pc(PROC_ADDR);
     cpu_resume();
-    while (!(read_status() & ST_CPU_HALTED));
+    wait_status(ST_CPU_HALTED);
+
+    crc = debug_instr_2(0xE5, 0xBC);                // MOV A,RNDL
+#ifdef GANG
+    for (n = 0; n < GANG_TARGETS; n++)
+        gang_crc[n] = gang_byte(gang_dd[n]);
+#endif
+    crc |= (uint16_t)debug_instr_2(0xE5, 0xBD) << 8;    // MOV A,RNDH
+#ifdef GANG
+    for (n = 0; n < GANG_TARGETS; n++)
+        gang_crc[n] |= (uint16_t)gang_byte(gang_dd[n]) << 8;
+#endif
+    return crc;
 }
 
+// Programs count pages from first, loaded at PAGE_ADDR onwards by
+// dbg_loadpage(), with one resume. flashProc is only uploaded once.
+static void write_flash_pages(uint8_t first, uint8_t count)
+{
+    if (!flash_proc_loaded)
+    {
+        write_xdata_memory(FLASH_DMA_ADDR, sizeof(flash_dma), flash_dma);
+        write_xdata_memory(FLASH_PROC_ADDR, sizeof(flashProc), flashProc);
+        flash_proc_loaded = 1;
+    }
+
+    debug_instr_2(0x7D, PAGE_ADDR >> 8);    // MOV R5,#buffer
+    debug_instr_2(0x7E, (first << 1) & 0x7E);   // MOV R6,#FADDRH
+    debug_instr_2(0x7F, count);             // MOV R7,#count
+    debug_instr_3(0x75,0xC7,0x51);
+    set_pc(FLASH_PROC_ADDR);
+    cpu_resume();
+    wait_status(ST_CPU_HALTED);
+}
 
 
-static void read_flash_page(uint32_t address, __xdata uint8_t *outputData)
+
+static void read_flash_page(uint32_t address)
 {
     read_code_memory(address & 0xFFFF, 
-                     (address >> 15) & 0x03, FLASHPAGE_SIZE, outputData);
+                     (address >> 15) & 0x03, FLASHPAGE_SIZE);
 }
 
 
 static void dbg_readpage(void)
 {
-    read_flash_page(page * 1024, rambuf);
+    read_flash_page(page * 1024);
 }
 
-static void dbg_writepage(void)
+// Forwards the page to buffer n in the target byte by byte as the UART
+// delivers it, rxfifo holds whatever arrives while the debug interface is
+// busy
+static void dbg_loadpage(uint8_t n)
+{
+    uint16_t i;
+
+    burst_begin(PAGE_ADDR + n * FLASHPAGE_SIZE, FLASHPAGE_SIZE);
+    for (i = 0; i < FLASHPAGE_SIZE; i++)
+    {
+        while(!cons_getch());
+        send_byte(page);
+    }
+    recv_byte();
+}
+
+static void dbg_erasepage(void)
 {
     uint32_t addr = page*1024;
-    write_flash_page(addr);
+    erase_flash_page(addr);
+}
+
+static void dbg_writepage(void)
+{
+    write_flash_pages(page, 1);
 }
 
 
@@ -296,11 +708,17 @@ uint8_t cons_getch(void)
     return 1;
 }
 
+// Returns as soon as the byte is in U0DBUF, waiting only for the previous
+// one, so the caller can get on with the next while this one is sent
 void cons_putc(uint8_t ch)
 {
+    if (tx_busy)
+    {
+        while(!(U0CSR & U0CSR_TX_BYTE)); // wait for previous byte to be transmitted
+        U0CSR &= ~U0CSR_TX_BYTE;         // Clear transmit byte status
+    }
     U0DBUF = ch;
-    while(!(U0CSR & U0CSR_TX_BYTE)); // wait for byte to be transmitted
-    U0CSR &= ~U0CSR_TX_BYTE;         // Clear transmit byte status
+    tx_busy = 1;
 }
 
 void uart0_isr(void) __interrupt URX0_VECTOR
@@ -336,6 +754,7 @@ void main(void)
 //    SLEEP |= SLEEP_OSC_PD;	// Disable RC oscillator now that we have an external crystal
 
     rxfifo_in = rxfifo_out = 0;
+    tx_busy = 0;
 
 	PERCFG = (PERCFG & ~PERCFG_U0CFG) | PERCFG_U1CFG;
 	P0SEL |= (1<<3) | (1<<2);
@@ -374,28 +793,95 @@ void main(void)
                     goto ack;
                 break;
 
+                case 'E':
+                    while(!cons_getch());
+                    dbg_erasepage();
+                    goto ack;
+                break;
+
                 case 'p':
                     while(!cons_getch());
                     dbg_writepage();
                     goto ack;
                 break;
 
+                case 'i':
+                    cons_putc(CCHL_CAPS);
+#ifdef GANG
+                    cons_putc(GANG_TARGETS);
+#endif
+                break;
+
+                case 'c':
+                    while(!cons_getch());
+                    n = page;
+                    while(!cons_getch());
+                    if (page == 0 || (uint16_t)n + page > FLASH_PAGES)
+                    {
+                        // as long as a CRC reply, so the host stays in step
+#ifdef GANG
+                        for (n = 0; n < GANG_TARGETS * 2; n++)
+                            cons_putc(0);
+                        cons_putc(gang_failed);
+#else
+                        cons_putc(0);
+                        cons_putc(0);
+#endif
+                        cons_putc(1);
+                        break;
+                    }
+                    i = crc_flash(n, page);
+#ifdef GANG
+                    // one CRC per target, then the ones which timed out
+                    for (n = 0; n < GANG_TARGETS; n++)
+                    {
+                        cons_putc(gang_crc[n] & 0xFF);
+                        cons_putc(gang_crc[n] >> 8);
+                    }
+                    cons_putc(gang_failed);
+#else
+                    cons_putc(i & 0xFF);
+                    cons_putc(i >> 8);
+#endif
+                    goto ack;
+                break;
+
                 case 'r':
                     while(!cons_getch());
                     dbg_readpage();
-                    for (i=0;i<1024;i++)
-                        cons_putc(rambuf[i]);
                     goto ack;
                 break;
             
                 case 'l':
-                    i = 0;
-                    while(i<1024)
+                    dbg_loadpage(0);
+                    goto ack;
+                break;
+
+                case 'L':
+                    while(!cons_getch());
+                    if (page >= MAX_PAGES)
+                    {
+                        // take the page anyway so that it is not read as
+                        // commands
+                        for (i = 0; i < FLASHPAGE_SIZE; i++)
+                            while(!cons_getch());
+                        cons_putc(1);
+                        break;
+                    }
+                    dbg_loadpage(page);
+                    goto ack;
+                break;
+
+                case 'P':
+                    while(!cons_getch());
+                    n = page;
+                    while(!cons_getch());
+                    if (page == 0 || page > MAX_PAGES || (uint16_t)n + page > FLASH_PAGES)
                     {
-                        while(!cons_getch());
-                        rambuf[i] = page;
-                        i++;
+                        cons_putc(1);
+                        break;
                     }
+                    write_flash_pages(n, page);
                     goto ack;
                 break;
 
@@ -406,7 +892,13 @@ void main(void)
                 break;
 
                 ack:
+#ifdef GANG
                     cons_putc(0);
+#else
+                    // 1 if the target stopped answering
+                    cons_putc(timed_out);
+                    timed_out = 0;
+#endif
             }
         }
     }
@@ -42,6 +42,10 @@ static 	uint8_t *spi0Mem = NULL;
 // Instead it prints out what it _would_ do if debug were 0
 static uint8_t debug = 0;
 
+// Mode + 1 last written to each pin by bcm2835_gpio_fsel_cached(), 0 when
+// not known
+static uint8_t fsel_cache[54];
+
 
 //
 // Low level register access functions
@@ -140,6 +144,8 @@ void bcm2835_gpio_fsel(uint8_t pin, uint8_t mode)
     uint32_t  mask = BCM2835_GPIO_FSEL_MASK << shift;
     uint32_t  value = mode << shift;
     bcm2835_peri_set_bits(paddr, value, mask);
+    if (pin < sizeof(fsel_cache))
+	fsel_cache[pin] = 0;
 }
 
 // Set putput pin
@@ -375,6 +381,64 @@ void bcm2835_gpio_set_pud(uint8_t pin, uint8_t pud)
     bcm2835_gpio_pudclk(pin, 0);
 }
 
+//
+// Fast path for bit banging
+//
+
+// Bit for a pin in GPSET0, GPCLR0 and GPLEV0
+uint32_t bcm2835_gpio_mask(uint8_t pin)
+{
+    return 1u << (pin % 32);
+}
+
+// Drive every pin in mask high with one write and no barrier
+void bcm2835_gpio_set_fast(uint32_t mask)
+{
+    if (debug)
+	printf("bcm2835_gpio_set_fast mask %08X\n", mask);
+    else
+	gpio[BCM2835_GPSET0/4] = mask;
+}
+
+// Drive every pin in mask low with one write and no barrier
+void bcm2835_gpio_clr_fast(uint32_t mask)
+{
+    if (debug)
+	printf("bcm2835_gpio_clr_fast mask %08X\n", mask);
+    else
+	gpio[BCM2835_GPCLR0/4] = mask;
+}
+
+// Set and clear pins together, one write for each register that changes
+void bcm2835_gpio_write_fast(uint32_t set, uint32_t clr)
+{
+    if (set)
+	bcm2835_gpio_set_fast(set);
+    if (clr)
+	bcm2835_gpio_clr_fast(clr);
+}
+
+// Levels of GPIO 0-31 with one read
+uint32_t bcm2835_gpio_lev_fast(void)
+{
+    if (debug)
+    {
+	printf("bcm2835_gpio_lev_fast\n");
+	return 0;
+    }
+    return gpio[BCM2835_GPLEV0/4];
+}
+
+// Function select which only reads and writes GPFSELn when the mode changes
+void bcm2835_gpio_fsel_cached(uint8_t pin, uint8_t mode)
+{
+    if (pin < sizeof(fsel_cache) && fsel_cache[pin] == mode + 1)
+	return;
+    bcm2835_gpio_fsel(pin, mode);
+    if (pin < sizeof(fsel_cache))
+	fsel_cache[pin] = mode + 1;
+}
+
 void bcm2835_spi_begin()
 {
     // Set the SPI0 pins to the Alt 0 function to enable SPI0 access on them
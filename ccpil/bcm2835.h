@@ -659,6 +659,43 @@ extern "C" {
 
     /// @} 
 
+    /// \defgroup fast Fast GPIO access
+    /// These functions are for bit banging. They write GPSET0 and GPCLR0
+    /// once without a barrier, and take masks from bcm2835_gpio_mask() so
+    /// several pins can be changed at once. Only GPIO 0-31 can be used.
+    /// @{
+
+    /// Returns the bit for a pin in GPSET0, GPCLR0 and GPLEV0
+    /// \param[in] pin GPIO number, or one of RPI_GPIO_P1_* from \ref RPiGPIOPin.
+    extern uint32_t bcm2835_gpio_mask(uint8_t pin);
+
+    /// Sets every output pin in the mask with one write
+    /// \param[in] mask Pin bits from bcm2835_gpio_mask()
+    extern void bcm2835_gpio_set_fast(uint32_t mask);
+
+    /// Clears every output pin in the mask with one write
+    /// \param[in] mask Pin bits from bcm2835_gpio_mask()
+    extern void bcm2835_gpio_clr_fast(uint32_t mask);
+
+    /// Sets the pins in set and clears the pins in clr, writing only the
+    /// registers which have bits to change
+    /// \param[in] set Pin bits to set
+    /// \param[in] clr Pin bits to clear
+    extern void bcm2835_gpio_write_fast(uint32_t set, uint32_t clr);
+
+    /// Reads the levels of GPIO 0-31 at once
+    /// \return GPLEV0, test it with masks from bcm2835_gpio_mask()
+    extern uint32_t bcm2835_gpio_lev_fast(void);
+
+    /// Like bcm2835_gpio_fsel(), but remembers the mode set for each pin
+    /// and does nothing if it is already in that mode. bcm2835_gpio_fsel()
+    /// forgets the remembered mode.
+    /// \param[in] pin GPIO number, or one of RPI_GPIO_P1_* from \ref RPiGPIOPin.
+    /// \param[in] mode Mode to set the pin to, one of BCM2835_GPIO_FSEL_* from \ref bcm2835FunctionSelect
+    extern void bcm2835_gpio_fsel_cached(uint8_t pin, uint8_t mode);
+
+    /// @}
+
     /// \defgroup spi SPI access
     /// These functions let you use SPI0 (Serial Peripheral Interface) to 
     /// interface with an external SPI device.
@@ -16,20 +16,23 @@
 
 static bool opt_flash = false;
 static char *flash_filename = NULL;
+static unsigned int opt_clock = 0;     // kHz, 0 finds the fastest reliable
 
 static struct option long_options[] =
 {
     {"help",    no_argument, 0, 'h'},
     {"flash",     required_argument, 0, 'f'},
+    {"clock",     required_argument, 0, 'c'},
     {0, 0, 0, 0}
 };
 
 static void usage(void)
 {
     fprintf(stderr, "ChipCon Pi Loader, Toby Jaffey <toby-ccpl@hodgepig.org>\n");
-    fprintf(stderr, "cctl-prog [-f file.hex]\n");
+    fprintf(stderr, "cctl-prog [-f file.hex] [-c kHz]\n");
     fprintf(stderr, "  --help           -h          This help\n");
     fprintf(stderr, "  --flash=file.hex -f file.hex Reflash device with intel hex file\n");
+    fprintf(stderr, "  --clock=kHz      -c kHz      Debug clock rate, found by readback if not given\n");
 }
 
 static int parse_options(int argc, char **argv)
@@ -39,7 +42,7 @@ static int parse_options(int argc, char **argv)
 
     while(1)
     {
-        c = getopt_long (argc, argv, "hf:", long_options, &option_index);
+        c = getopt_long (argc, argv, "hf:c:", long_options, &option_index);
         if (c == -1)
             break;
         switch(c)
@@ -51,6 +54,11 @@ static int parse_options(int argc, char **argv)
                 opt_flash = true;
                 flash_filename = strdup(optarg);
             break;
+            case 'c':
+                opt_clock = strtoul(optarg, NULL, 0);
+                if (0 == opt_clock)
+                    return 1;
+            break;
             default:
                 return 1;
             break;
@@ -67,15 +75,21 @@ static void dump(const uint8_t *p, size_t len)
     printf("\n");
 }
 
-static int program_verify_page(const uint8_t *data, uint8_t page)
+static bool page_empty(const uint8_t *p)
 {
-    uint8_t verbuf[1024];
+    int j;
 
-    if (0 != dbg_writepage(page, data))
+    for (j=0;j<1024;j++)
     {
-        fprintf(stderr, "program_page failed\n");
-        return 1;
+        if (p[j] != 0xFF)
+            return false;
     }
+    return true;
+}
+
+static int verify_page(const uint8_t *data, uint8_t page)
+{
+    uint8_t verbuf[1024];
 
     if (0 != dbg_readpage(page, verbuf))
     {
@@ -102,6 +116,7 @@ int main(int argc, char *argv[])
 {
     uint8_t *buf;
     int i;
+    int count;
 
     if (NULL == (buf=malloc(FLASH_SIZE)))
     {
@@ -129,6 +144,18 @@ int main(int argc, char *argv[])
             return 1;
         }
 
+        if (opt_clock)
+            dbg_set_clock(opt_clock);
+        else if (0 != dbg_auto_clock())
+        {
+            fprintf(stderr, "No reliable debug clock found, check the wiring\n");
+            return 1;
+        }
+        if (dbg_clock_khz())
+            printf("Debug clock %u kHz\n", dbg_clock_khz());
+        else
+            printf("Debug clock unthrottled\n");
+
         memset(buf, 0xFF, FLASH_SIZE);
         if (0 != read_hexfile(buf, FLASH_SIZE, flash_filename))
         {
@@ -142,31 +169,36 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        for (i=0;i<FLASH_SIZE;i+=1024)
+        for (i=0;i<FLASH_SIZE;i+=count*1024)
         {
-            bool skip = true;
             int j;
 
-            for (j=i;j<i+1024;j++)
-            {
-                if (buf[j] != 0xFF)
-                {
-                    skip = false;
-                    break;
-                }
-            }
-            if (skip)
+            count = 1;
+            if (page_empty(buf + i))
             {
                 printf("Skipping blank page %d\n", i/1024);
                 continue;
             }
 
-            printf("Programming and verifying page %d\n", i/1024);
-            if (0 != program_verify_page(buf + i, i/1024))
+            // program as many following pages with data as the target can hold
+            while (count < DBG_MAX_PAGES && i + count * 1024 < FLASH_SIZE && !page_empty(buf + i + count * 1024))
+                count++;
+
+            printf("Programming and verifying pages %d-%d\n", i/1024, i/1024 + count - 1);
+            if (0 != dbg_writepages(i/1024, count, buf + i))
             {
-                fprintf(stderr, "FAILED\n");
+                fprintf(stderr, "program_page failed\n");
                 return 1;
             }
+
+            for (j=0;j<count;j++)
+            {
+                if (0 != verify_page(buf + i + j * 1024, i/1024 + j))
+                {
+                    fprintf(stderr, "FAILED\n");
+                    return 1;
+                }
+            }
         }
 
         printf("Programming complete\n");
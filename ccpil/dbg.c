@@ -24,11 +24,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <time.h>
 
 #include "bcm2835.h"
+#include "dbg.h"
 
-#define NUM_ATTEMPTS 100
+#define STATUS_TIMEOUT_MS 500    // longer than a chip erase or a 3 page write
 
 #define PIN_DD RPI_GPIO_P1_11
 #define PIN_DC RPI_GPIO_P1_12
@@ -48,36 +50,79 @@
 #define FLASH_WORD_SIZE         2
 #define WORDS_PER_FLASH_PAGE  512
 
+// Target RAM layout, DBG_MAX_PAGES page buffers from PAGE_ADDR then the
+// flash routine and its DMA descriptor
+#define PAGE_ADDR            0xF000
+#define FLASH_PROC_ADDR      0xFC00
+#define FLASH_DMA_ADDR       0xFE00
+
+static bool flash_proc_loaded = false;   // until the next dbg_init()
+
+// Half of the DC period, 0 runs DC as fast as the GPIO writes go
+static unsigned int half_period_ns = 500;
+static unsigned long spins_per_us = 1;
+
+// GPSET0/GPCLR0/GPLEV0 bits, set up by dbg_init()
+static uint32_t dd_mask;
+static uint32_t dc_mask;
+
+// Clock half periods tried by dbg_auto_clock(), fastest first
+static const unsigned int clock_steps[] =
+{
+    0, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000
+};
+#define NUM_CLOCK_STEPS (sizeof(clock_steps) / sizeof(clock_steps[0]))
+
 void critical_error(const char *msg)
 {
     fprintf(stderr, "Critical error: %s\n", msg);
     exit(1);
 }
 
+// Count how many busy loops run in a microsecond against the monotonic
+// clock, nanosleep() takes tens of microseconds whatever it is asked for
+static void calibrate_spin(void)
+{
+    struct timespec t0, t1;
+    volatile unsigned long n;
+    const unsigned long loops = 1000000;
+    long long ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (n = 0; n < loops; n++)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+    spins_per_us = ns > 0 ? loops * 1000 / ns : 1;
+    if (spins_per_us == 0)
+        spins_per_us = 1;
+}
+
 static void delay_ns(unsigned int ns)
 {
-    struct timespec sleeper, dummy;
-    sleeper.tv_sec  = 0;
-    sleeper.tv_nsec = ns ;
-    nanosleep (&sleeper, &dummy) ;
+    volatile unsigned long n = (unsigned long)ns * spins_per_us / 1000;
+
+    while (n--)
+        ;
 }
 
 static void send_byte(uint8_t ch)
 {
     int8_t i;
-    bcm2835_gpio_fsel(PIN_DD, BCM2835_GPIO_FSEL_OUTP);
+    bcm2835_gpio_fsel_cached(PIN_DD, BCM2835_GPIO_FSEL_OUTP);
 
     for (i = 7; i >= 0; i--)
     {
         if (ch & (1 << i))
-            bcm2835_gpio_write(PIN_DD, HIGH);
+            bcm2835_gpio_set_fast(dd_mask);
         else
-            bcm2835_gpio_write(PIN_DD, LOW);
+            bcm2835_gpio_clr_fast(dd_mask);
 
-        bcm2835_gpio_write(PIN_DC, HIGH);
-        delay_ns(1);
-        bcm2835_gpio_write(PIN_DC, LOW);
-        delay_ns(1);
+        bcm2835_gpio_set_fast(dc_mask);
+        delay_ns(half_period_ns);
+        bcm2835_gpio_clr_fast(dc_mask);
+        delay_ns(half_period_ns);
     }
 }
 
@@ -86,16 +131,16 @@ static uint8_t recv_byte(void)
     uint8_t ch = 0;
     int8_t i;
 
-    bcm2835_gpio_fsel(PIN_DD, BCM2835_GPIO_FSEL_INPT);
-    bcm2835_gpio_set_pud(PIN_DD, BCM2835_GPIO_PUD_DOWN);
+    bcm2835_gpio_fsel_cached(PIN_DD, BCM2835_GPIO_FSEL_INPT);
 
     for (i = 7; i >= 0; i--)
     {
-        bcm2835_gpio_write(PIN_DC, HIGH);
-        delay_ns(1);
-        if (bcm2835_gpio_lev(PIN_DD))
+        bcm2835_gpio_set_fast(dc_mask);
+        delay_ns(half_period_ns);
+        if (bcm2835_gpio_lev_fast() & dd_mask)
             ch |= (1 << i);
-        bcm2835_gpio_write(PIN_DC, LOW);
+        bcm2835_gpio_clr_fast(dc_mask);
+        delay_ns(half_period_ns);
     }
 #ifdef DEBUG
     fprintf(stderr, "RX: %02X\n", ch);
@@ -104,15 +149,10 @@ static uint8_t recv_byte(void)
 }
 
 
-int dbg_init(void)
+// Reset the target into debug mode
+static void debug_enter(void)
 {
-    if (!bcm2835_init())
-        return 1;
-
-    bcm2835_gpio_fsel(PIN_RST, BCM2835_GPIO_FSEL_OUTP);
-    bcm2835_gpio_fsel(PIN_DD, BCM2835_GPIO_FSEL_OUTP);
-    bcm2835_gpio_fsel(PIN_DC, BCM2835_GPIO_FSEL_OUTP);
-
+    bcm2835_gpio_fsel_cached(PIN_DD, BCM2835_GPIO_FSEL_OUTP);
     bcm2835_gpio_write(PIN_DD, LOW);
 
     // send debug init sequence
@@ -131,6 +171,24 @@ int dbg_init(void)
     bcm2835_gpio_write(PIN_RST, HIGH);
     delay(1);
 
+    flash_proc_loaded = false;
+}
+
+int dbg_init(void)
+{
+    if (!bcm2835_init())
+        return 1;
+
+    bcm2835_gpio_fsel(PIN_RST, BCM2835_GPIO_FSEL_OUTP);
+    bcm2835_gpio_fsel(PIN_DC, BCM2835_GPIO_FSEL_OUTP);
+    // the pull-down holds while DD is switched between input and output
+    bcm2835_gpio_set_pud(PIN_DD, BCM2835_GPIO_PUD_DOWN);
+
+    dd_mask = bcm2835_gpio_mask(PIN_DD);
+    dc_mask = bcm2835_gpio_mask(PIN_DC);
+
+    calibrate_spin();
+    debug_enter();
     return 0;
 }
 
@@ -147,17 +205,27 @@ static uint8_t read_status(void)
     return recv_byte();
 }
 
+// Polls until bit is set in the status, timed against the monotonic clock
+// as the polls themselves now only take microseconds
+static int wait_status(uint8_t bit)
+{
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!(read_status() & bit))
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 > STATUS_TIMEOUT_MS)
+            return 1;
+    }
+    return 0;
+}
+
 int dbg_mass_erase(void)
 {
-    int attempts = NUM_ATTEMPTS;
     send_byte(0x14);
     recv_byte();
-    while (attempts && !(read_status() & ST_CHIP_ERASE_DONE))
-        attempts--;
-
-    if (0 == attempts)
-        return 1;
-    return 0;
+    return wait_status(ST_CHIP_ERASE_DONE);
 }
 
 static uint8_t debug_instr_1(uint8_t in0)
@@ -195,6 +263,16 @@ static void write_xdata_memory(uint16_t address, uint16_t count, const uint8_t *
     }
 }
 
+static void read_xdata_memory(uint16_t address, uint16_t count, uint8_t *buf)
+{
+    int i;
+    debug_instr_3(0x90,address >> 8,address);
+    for (i = 0; i < count; ++i) {
+        buf[i] = debug_instr_1(0xE0);
+        debug_instr_1(0xA3);
+    }
+}
+
 static void set_pc(uint16_t address)
 {
     debug_instr_3(0x02,address >> 8,address);
@@ -226,51 +304,67 @@ static void read_code_memory(uint16_t address,
     }
 }
 
-static uint8_t updProc[] =
-{ 
-    0x75, 0xAD, /*ADDRESS*/0x00,
-    0x75, 0xAC, 0x00, 
-    0x75, 0xAB, 0x23, 0x00,
+// Target DMA channel 0 descriptor which feeds a page to FWDATA (0xDFAF)
+// for the flash controller, the source page is set by flashProc
+static uint8_t flash_dma[] =
+{
+    0xF0, 0x00,     // src
+    0xDF, 0xAF,     // dst FWDATA
+    FLASHPAGE_SIZE >> 8, FLASHPAGE_SIZE & 0xFF,
+    18,             // single byte transfers, FLASH trigger
+    0x42            // src increment, high priority
+};
+
+// Erases and writes R7 pages, starting with FADDRH R6 from the buffer at
+// R5 << 8. Each page is written by DMA, the CPU only waits for it.
+static uint8_t flashProc[] =
+{
+    0x75, 0xAB, 0x23,                       // FWT
+    0x75, 0xD5, FLASH_DMA_ADDR >> 8,        // DMA0CFGH
+    0x75, 0xD4, FLASH_DMA_ADDR & 0xFF,      // DMA0CFGL
+    0x8E, 0xAD,                             // FADDRH = R6
+    0x75, 0xAC, 0x00,                       // FADDRL = 0
     0x75, 0xAE, 0x01, // ------
-    0xE5, 0xAE,       // erase code
+    0xE5, 0xAE,       // erase page
     0x20, 0xE7, 0xFB, // ------
-    0x90, 0xF0, 0x00,
-    0x7F, WORDS_PER_FLASH_PAGE >> 8,
-    0x7E, WORDS_PER_FLASH_PAGE & 0xFF,
-    0x75, 0xAE, 0x02,
-    0x7D, FLASH_WORD_SIZE,
-    0xE0, 
-    0xA3, 
-    0xF5, 0xAF,
-    0xDD, 0xFA,
-    0xE5, 0xAE,
-    0x20, 0xE6, 0xFB,
-    0xDE, 0xF1,
-    0xDF, 0xEF,
+    0x90, FLASH_DMA_ADDR >> 8, FLASH_DMA_ADDR & 0xFF,
+    0xED,                                   // src high = R5
+    0xF0,
+    0x53, 0xD1, 0xFE,                       // clear DMAIF0
+    0x75, 0xD6, 0x01,                       // arm channel 0
+    0x75, 0xAE, 0x02, // ------
+    0xE5, 0xD1,       // write page
+    0x30, 0xE0, 0xFB, // until DMA done
+    0xE5, 0xAE,       // and flash
+    0x20, 0xE7, 0xFB, // not busy
+    0x0E, 0x0E,                             // R6 += 2
+    0xED, 0x24, 0x04, 0xFD,                 // R5 += 4
+    0xDF, 0xD3,                             // next page
     0xA5
 };
 
 
-static int write_flash_page(uint32_t address, const uint8_t *buf)
+// Programs count pages from first with one resume, flashProc is only
+// uploaded once
+static int write_flash_pages(uint8_t first, uint8_t count, const uint8_t *buf)
 {
-    int attempts = NUM_ATTEMPTS;
-    uint8_t updProcSize = sizeof(updProc);
-
-    updProc[2] = ((address >> 8) / FLASH_WORD_SIZE) & 0x7E;
+    if (!flash_proc_loaded)
+    {
+        write_xdata_memory(FLASH_DMA_ADDR, sizeof(flash_dma), flash_dma);
+        write_xdata_memory(FLASH_PROC_ADDR, sizeof(flashProc), flashProc);
+        flash_proc_loaded = true;
+    }
 
-    write_xdata_memory(0xF000,  FLASHPAGE_SIZE, buf);
+    write_xdata_memory(PAGE_ADDR, count * FLASHPAGE_SIZE, buf);
 
-    write_xdata_memory(0xF000 + FLASHPAGE_SIZE, updProcSize, updProc);
+    debug_instr_2(0x7D, PAGE_ADDR >> 8);        // MOV R5,#buffer
+    debug_instr_2(0x7E, (first << 1) & 0x7E);   // MOV R6,#FADDRH
+    debug_instr_2(0x7F, count);                 // MOV R7,#count
     debug_instr_3(0x75, 0xC7, 0x51);
 
-    set_pc(0xF000 + FLASHPAGE_SIZE);
+    set_pc(FLASH_PROC_ADDR);
     cpu_resume();
-    while (attempts && !(read_status() & ST_CPU_HALTED))
-        attempts--;
-
-    if (0 == attempts)
-        return 1;
-    return 0;
+    return wait_status(ST_CPU_HALTED);
 }
 
 
@@ -290,7 +384,71 @@ int dbg_readpage(uint8_t page, uint8_t *buf)
 
 int dbg_writepage(uint8_t page, const uint8_t *buf)
 {
-    uint32_t addr = page*1024;
-    return write_flash_page(addr, buf);
+    return write_flash_pages(page, 1, buf);
+}
+
+int dbg_writepages(uint8_t page, uint8_t count, const uint8_t *buf)
+{
+    if (count < 1 || count > DBG_MAX_PAGES)
+        return 1;
+    return write_flash_pages(page, count, buf);
 }
 
+
+int dbg_set_clock(unsigned int khz)
+{
+    if (0 == khz)
+        return 1;
+    half_period_ns = 500000 / khz;
+    return 0;
+}
+
+// 0 when DC runs as fast as the GPIO writes go
+unsigned int dbg_clock_khz(void)
+{
+    if (0 == half_period_ns)
+        return 0;
+    return 500000 / half_period_ns;
+}
+
+// Write patterns to the target's RAM and read them back at the current
+// clock
+static bool clock_test(void)
+{
+    uint8_t pattern[64];
+    uint8_t readback[64];
+    int round;
+    unsigned int i;
+
+    for (round = 0; round < 4; round++)
+    {
+        for (i = 0; i < sizeof(pattern); i++)
+            pattern[i] = (i & 1) ? ~(i * 37 + round) : (i * 37 + round);
+        write_xdata_memory(PAGE_ADDR, sizeof(pattern), pattern);
+        read_xdata_memory(PAGE_ADDR, sizeof(readback), readback);
+        if (0 != memcmp(pattern, readback, sizeof(pattern)))
+            return false;
+    }
+    return true;
+}
+
+// Find the fastest clock which passes clock_test() and settle one step
+// slower than that for margin. A failed step can leave the target out of
+// step with us, so it is reset into debug mode before the next one.
+int dbg_auto_clock(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_CLOCK_STEPS; i++)
+    {
+        half_period_ns = clock_steps[i];
+        if (clock_test())
+        {
+            if (i + 1 < NUM_CLOCK_STEPS)
+                half_period_ns = clock_steps[i + 1];
+            return 0;
+        }
+        debug_enter();
+    }
+    return 1;
+}
@@ -1,11 +1,18 @@
 #ifndef DBG_H
 #define DBG_H 1
 
+// Pages which fit in the target's RAM for dbg_writepages()
+#define DBG_MAX_PAGES 3
+
 extern int dbg_init(void);
 extern int dbg_mass_erase(void);
 extern int dbg_writepage(uint8_t page, const uint8_t *buf);
-extern int dbg_readpage(uint8_t page, const uint8_t *buf);
+extern int dbg_writepages(uint8_t page, uint8_t count, const uint8_t *buf);
+extern int dbg_readpage(uint8_t page, uint8_t *buf);
 extern void dbg_reset(void);
+extern int dbg_set_clock(unsigned int khz);
+extern int dbg_auto_clock(void);
+extern unsigned int dbg_clock_khz(void);
 
 #endif
 
@@ -0,0 +1,1085 @@
+/*
+ * CCRL - ChipCon Radio Loader
+ * Serial to radio relay for updating cctl-rf nodes with cctl-prog -w
+ *
+ * Runs as an application behind cctl. cctl-prog's serial commands are
+ * turned into cctl-rf radio packets, and a whole page can be sent in one
+ * frame so that the relay fragments it and handles retries itself.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+// Select crystal frequency, must match the cctl-rf nodes
+#define CRYSTAL_26_MHZ
+
+#include <stdint.h>
+#include <cc1110.h>
+#include "cc1110-ext.h"
+#include "cctl-app.h"
+
+#define RADIOBUF_MAX 256
+#define RXFIFO_SIZE 1280    // more than a 'W' or 'M' frame, 1026 bytes
+
+// Capabilities advertised in the cctl-rf boot beacon
+#define CAP_BURST_LOAD 0x01
+#define CAP_LARGE_SEGMENTS 0x02
+#define CAP_PAGE_CRC 0x04
+#define CAP_MULTICAST 0x08
+#define CAP_RATE_PROFILES 0x10
+#define CAP_CHANNEL_SELECT 0x20
+
+// Radio commands, see cctl-rf/README.markdown
+#define CMD_PING 0
+#define CMD_ERASE 1
+#define CMD_PROGRAM 2
+#define CMD_READ 3
+#define CMD_LOAD 4
+#define CMD_JUMP 5
+#define CMD_BURST 6
+#define CMD_SEG_MAP 7
+#define CMD_CRC 8
+#define CMD_RATE 9
+#define CMD_BEACON 0x10
+#define CMD_WAKE 0x11
+
+#define RELAY_ADDR 0xFD
+#define BOOT_CHANNEL 0  // CHANNR in cctl-rf/start.asm
+#define SEGLEN_MAX 240
+
+// Timer 3 overflows every 20ms, the node waits one before replying and an
+// erase takes another
+#define REPLY_TIMEOUT 4
+#define KEEPALIVE 16    // ping the node after ~320ms without host commands
+#define MAX_TRIES 8     // per radio packet
+#define PAGE_TRIES 3    // per page in a 'W' frame
+#define MAX_NODES 8     // in one multicast update
+#define JOIN_TIME 250   // wait ~5s after the first node for the others
+#define FLASH_TIME 3    // for a node to erase or program a page
+#define BROADCAST 0x00
+#define MCAST_CAPS (CAP_MULTICAST | CAP_BURST_LOAD | CAP_PAGE_CRC)
+#define RATE_DEFAULT 2  // 250 kbaud in rate_order[]
+#define RATE_KEEPALIVE 2    // the node falls back to 250k after ~100ms alone
+#define LQI_GOOD 16     // lower is better, step up below this
+#define LOST_MAX 2      // retries between rate checks before stepping down
+
+// Address of radio data register
+#define RFD_ADDR 0xDFD9
+
+struct cc_dma_channel
+{
+    uint8_t src_high;
+    uint8_t src_low;
+    uint8_t dst_high;
+    uint8_t dst_low;
+    uint8_t len_high;
+    uint8_t len_low;
+    uint8_t cfg0;
+    uint8_t cfg1;
+};
+
+#define DMA_CFG0_TRIGGER_RADIO     19
+#define DMA_CFG1_SRCINC_0      (0 << 6)
+#define DMA_CFG1_SRCINC_1      (1 << 6)
+#define DMA_CFG1_DESTINC_0     (0 << 4)
+#define DMA_CFG1_DESTINC_1     (1 << 4)
+#define DMA_CFG1_PRIORITY_HIGH     (2 << 0)
+#define DMAARM_DMAARM1         (1 << 1)
+#define DMAARM_ABORT           (1 << 7)
+#define DMA_LEN_HIGH_VLEN_PLUS_1   (1 << 5)
+#define DMA_LEN_HIGH_VLEN_PLUS_3   (4 << 5)
+#define DMA_CFG0_WORDSIZE_8        (0 << 7)
+#define DMA_CFG0_TMODE_SINGLE      (0 << 5)
+
+static __xdata struct cc_dma_channel dma1_config;  // radio
+
+static __xdata uint8_t txbuf[RADIOBUF_MAX];
+static __xdata uint8_t radiobuf[RADIOBUF_MAX];
+static __xdata uint8_t page[1024];
+
+static __xdata uint8_t rxfifo[RXFIFO_SIZE];
+static volatile uint16_t rxfifo_in = 0;
+static uint16_t rxfifo_out = 0;
+static volatile uint8_t rx_overrun = 0;     // bytes were lost, FIFO was full
+
+static uint8_t connected = 0;
+static uint8_t node;        // address of the node being updated
+static uint8_t caps;
+static uint8_t seglen;
+static uint16_t retries;    // radio retries since the host last asked
+static uint8_t channel = BOOT_CHANNEL;  // for updates, set by the host
+static uint8_t node_filter = 0;         // only answer this node, 0 for any
+static uint8_t mcast = 0;               // updating nodes[] together
+static uint8_t num_nodes;
+static uint8_t nodes[MAX_NODES];
+static uint8_t joined;                  // bit per nodes[] entry still updating
+static uint8_t rate = RATE_DEFAULT;     // index into rate_order[]
+static uint8_t rate_max;                // highest rate the node has kept up with
+static uint8_t lost;                    // retries since the last rate check
+
+// cctl-rf's RATE_PROFILES, MDMCFG4, MDMCFG3, MDMCFG2, DEVIATN
+static const __code uint8_t profiles[4][4] = {
+#ifdef CRYSTAL_26_MHZ
+    { 0x2D, 0x3B, 0x13, 0x62 },     // 250 kbaud GFSK
+    { 0x0E, 0x3B, 0x73, 0x00 },     // 500 kbaud MSK
+    { 0x5B, 0xF8, 0x13, 0x47 },     // 100 kbaud GFSK
+    { 0xCA, 0x83, 0x13, 0x35 },     // 38.4 kbaud GFSK
+#endif
+#ifdef CRYSTAL_24_MHZ
+    { 0x1D, 0x55, 0x13, 0x62 },     // 250 kbaud GFSK
+    { 0x0E, 0x55, 0x73, 0x00 },     // 500 kbaud MSK
+    { 0x5C, 0x11, 0x13, 0x47 },     // 100 kbaud GFSK
+    { 0xCA, 0xA3, 0x13, 0x35 },     // 38.4 kbaud GFSK
+#endif
+};
+static const __code uint8_t rate_order[4] = { 3, 2, 0, 1 };     // slowest first
+
+// The host may send a whole frame while we are waiting on the radio
+void uart0_isr(void) __interrupt URX0_VECTOR
+{
+    uint16_t next = rxfifo_in + 1;
+    uint8_t ch = U0DBUF;
+
+    URX0IF = 0;
+    if (next == RXFIFO_SIZE)
+        next = 0;
+    if (next == rxfifo_out)
+    {
+        rx_overrun = 1;
+        return;
+    }
+    rxfifo[rxfifo_in] = ch;
+    rxfifo_in = next;
+}
+
+uint8_t cons_ready(void)
+{
+    return rxfifo_in != rxfifo_out;
+}
+
+uint8_t cons_getc(void)
+{
+    uint8_t ch;
+
+    while(!cons_ready())
+    {
+        // the rest of the frame may have been lost, do not wait for it
+        if (rx_overrun)
+            return 0;
+    }
+    ch = rxfifo[rxfifo_out];
+    if (rxfifo_out + 1 == RXFIFO_SIZE)
+        rxfifo_out = 0;
+    else
+        rxfifo_out++;
+    return ch;
+}
+
+void cons_putc(uint8_t ch)
+{
+    U0DBUF = ch;
+    while(!(U0CSR & U0CSR_TX_BYTE)); // wait for byte to be transmitted
+    U0CSR &= ~U0CSR_TX_BYTE;         // Clear transmit byte status
+}
+
+void radio_dma(uint8_t tx)
+{
+    DMAARM = DMAARM_ABORT | DMAARM_DMAARM1;
+    if (tx)
+    {
+        dma1_config.src_high = (uint16_t)txbuf >> 8;
+        dma1_config.src_low  = (uint16_t)txbuf & 0x00FF;
+        dma1_config.dst_high = RFD_ADDR >> 8;
+        dma1_config.dst_low  = RFD_ADDR & 0x00FF;
+        dma1_config.len_high = DMA_LEN_HIGH_VLEN_PLUS_1 | (RADIOBUF_MAX >> 8);
+        dma1_config.cfg1 = DMA_CFG1_SRCINC_1 | DMA_CFG1_DESTINC_0 | DMA_CFG1_PRIORITY_HIGH;
+    }
+    else
+    {
+        dma1_config.src_high = RFD_ADDR >> 8;
+        dma1_config.src_low  = RFD_ADDR & 0x00FF;
+        dma1_config.dst_high = (uint16_t)radiobuf >> 8;
+        dma1_config.dst_low  = (uint16_t)radiobuf & 0x00FF;
+        dma1_config.len_high = DMA_LEN_HIGH_VLEN_PLUS_3 | (RADIOBUF_MAX >> 8);
+        dma1_config.cfg1 = DMA_CFG1_SRCINC_0 | DMA_CFG1_DESTINC_1 | DMA_CFG1_PRIORITY_HIGH;
+    }
+    DMAARM |= DMAARM_DMAARM1;
+}
+
+void radio_init(void)
+{
+    SYNC1      = 0xD3;
+    SYNC0      = 0x91;
+    PKTLEN     = 0xFF;
+    PKTCTRL1   = 0x05;  // address check, no broadcast
+    PKTCTRL0   = 0x45;
+    ADDR       = RELAY_ADDR;
+    CHANNR     = 0x00;
+    FSCTRL1    = 0x0C;
+    FSCTRL0    = 0x00;
+#ifdef CRYSTAL_26_MHZ
+    FREQ2      = 0x21;
+    FREQ1      = 0x65;
+    FREQ0      = 0x6A;
+    MDMCFG4    = 0x2D;
+    MDMCFG3    = 0x3B;
+#endif
+#ifdef CRYSTAL_24_MHZ
+    FREQ2      = 0x24;
+    FREQ1      = 0x2D;
+    FREQ0      = 0xDD;
+    MDMCFG4    = 0x1D;
+    MDMCFG3    = 0x55;
+#endif
+    MDMCFG2    = 0x13;
+    MDMCFG1    = 0x22;
+    MDMCFG0    = 0xF8;
+    DEVIATN    = 0x62;
+    MCSM2      = 0x07;
+    MCSM1      = 0x30;
+    MCSM0      = 0x18;
+    FOCCFG     = 0x1D;
+    BSCFG      = 0x1C;
+    AGCCTRL2   = 0xC7;
+    AGCCTRL1   = 0x00;
+    AGCCTRL0   = 0xB0;
+    FREND1     = 0xB6;
+    FREND0     = 0x10;
+    FSCAL3     = 0xEA;
+    FSCAL2     = 0x2A;
+    FSCAL1     = 0x00;
+    FSCAL0     = 0x1F;
+    TEST1      = 0x31;
+    TEST0      = 0x09;
+    PA_TABLE0  = 0x50;
+
+    dma1_config.len_low = RADIOBUF_MAX & 0x00FF;
+    dma1_config.cfg0 = DMA_CFG0_WORDSIZE_8 | DMA_CFG0_TMODE_SINGLE | DMA_CFG0_TRIGGER_RADIO;
+    DMA1CFGH = ((uint16_t)&dma1_config >> 8) & 0x00FF;
+    DMA1CFGL = (uint16_t)&dma1_config & 0x00FF;
+    RFIF = 0;
+    RFST = RFST_SIDLE;
+    while(MARCSTATE != MARC_STATE_IDLE);
+}
+
+void radio_channel(uint8_t ch)
+{
+    RFST = RFST_SIDLE;
+    while(MARCSTATE != MARC_STATE_IDLE);
+    CHANNR = ch;
+}
+
+void radio_rate(uint8_t r)
+{
+    uint8_t p = rate_order[r];
+
+    rate = r;
+    RFST = RFST_SIDLE;
+    while(MARCSTATE != MARC_STATE_IDLE);
+    MDMCFG4 = profiles[p][0];
+    MDMCFG3 = profiles[p][1];
+    MDMCFG2 = profiles[p][2];
+    DEVIATN = profiles[p][3];
+}
+
+void tx_pkt(void)
+{
+    RFST = RFST_SIDLE;
+    while(MARCSTATE != MARC_STATE_IDLE);
+    txbuf[1] = node;
+    radio_dma(1);
+    RFST = RFST_STX;
+    while(MARCSTATE != MARC_STATE_TX);
+    while(MARCSTATE != MARC_STATE_IDLE);
+    RFIF = 0;
+}
+
+void rx_start(void)
+{
+    RFIF = 0;
+    radio_dma(0);
+    RFST = RFST_SRX;
+    while(MARCSTATE != MARC_STATE_RX);
+}
+
+// Poll for a packet with a good CRC, restarting RX after bad ones
+uint8_t rx_pkt(void)
+{
+    if (RFIF & RFIF_IRQ_DONE)
+    {
+        RFIF = 0;
+        if (LQI & 0x80)
+        {
+            while(MARCSTATE != MARC_STATE_IDLE);
+            return 1;
+        }
+    }
+    if (MARCSTATE != MARC_STATE_RX)
+        rx_start();
+    return 0;
+}
+
+// Wait up to REPLY_TIMEOUT Timer 3 overflows for the node's reply
+uint8_t rx_reply(void)
+{
+    uint8_t t = REPLY_TIMEOUT;
+
+    rx_start();
+    T3OVFIF = 0;
+    while(t)
+    {
+        if (rx_pkt() && radiobuf[2] == txbuf[2])
+            return 1;
+        if (T3OVFIF)
+        {
+            T3OVFIF = 0;
+            t--;
+        }
+    }
+    RFST = RFST_SIDLE;
+    return 0;
+}
+
+void disconnect(void)
+{
+    connected = 0;
+    mcast = 0;
+    radio_channel(BOOT_CHANNEL);
+    if (rate != RATE_DEFAULT)
+        radio_rate(RATE_DEFAULT);
+}
+
+void wait_ticks(uint8_t t)
+{
+    T3OVFIF = 0;
+    while(t)
+    {
+        if (T3OVFIF)
+        {
+            T3OVFIF = 0;
+            t--;
+        }
+    }
+}
+
+// Let the node store what it was sent and get back to RX
+void settle(void)
+{
+    uint8_t n = T3CNT;
+
+    while((uint8_t)(T3CNT - n) < 16);
+}
+
+// Send a command to every node, nothing is acked. The channel is in the
+// last byte so that a node which takes a broadcast as the answer to its
+// boot packets still moves to the right one.
+void broadcast(uint8_t cmd, uint8_t pg)
+{
+    node = BROADCAST;
+    txbuf[0] = 4;
+    txbuf[2] = cmd;
+    txbuf[3] = pg;
+    txbuf[4] = channel;
+    tx_pkt();
+    settle();
+}
+
+// Keep every node's watchdog fed while one of them is being dealt with
+void feed(void)
+{
+    uint8_t save[5];
+    uint8_t to = node;
+    uint8_t n;
+
+    for (n=0;n<5;n++)
+        save[n] = txbuf[n];
+    broadcast(CMD_PING, seglen);
+    for (n=0;n<5;n++)
+        txbuf[n] = save[n];
+    node = to;
+}
+
+uint8_t send_tries(void)
+{
+    uint8_t n;
+
+    for (n=0;n<MAX_TRIES;n++)
+    {
+        if (n > 0)
+        {
+            retries++;
+            if (lost < 0xFF)
+                lost++;
+        }
+        if (mcast)
+            feed();
+        tx_pkt();
+        if (rx_reply())
+            return 0;
+    }
+    return 1;
+}
+
+// Send txbuf until the node answers the same command
+uint8_t transact(void)
+{
+    if (0 == send_tries())
+        return 0;
+    if (rate != RATE_DEFAULT)
+    {
+        // the node goes back to 250k when it stops hearing us, and this
+        // rate is not to be tried again
+        if (rate > RATE_DEFAULT)
+            rate_max = rate - 1;
+        radio_rate(RATE_DEFAULT);
+        if (0 == send_tries())
+            return 0;
+    }
+    // node has gone, wait for its next beacon, the others in a multicast
+    // update carry on
+    if (!mcast)
+        disconnect();
+    return 1;
+}
+
+uint8_t command(uint8_t cmd, uint8_t pg)
+{
+    txbuf[0] = 4;
+    txbuf[2] = cmd;
+    txbuf[3] = pg;
+    txbuf[4] = 1;   // page count for CMD_CRC
+    return transact();
+}
+
+// Ping the node, then step the data rate up if it hears us well and
+// nothing was lost since the last check, or down if packets were
+void rate_adjust(void)
+{
+    uint8_t to = rate;
+
+    if (0 != command(CMD_PING, 0))
+        return;
+    if (!(caps & CAP_RATE_PROFILES) || mcast)
+        return;
+
+    if (lost > LOST_MAX && rate > 0)
+        to = rate - 1;
+    else if (lost == 0 && radiobuf[4] < LQI_GOOD && rate < rate_max)
+        to = rate + 1;
+    lost = 0;
+    if (to == rate)
+        return;
+
+    // acked at the old rate, then both sides switch
+    if (0 != command(CMD_RATE, rate_order[to]))
+        return;
+    if (to < rate)
+        rate_max = to;
+    radio_rate(to);
+    command(CMD_PING, 0);
+    lost = 0;
+}
+
+uint8_t seg_len(uint8_t s)
+{
+    uint16_t n = 1024 - (uint16_t)s * seglen;
+
+    if (n > seglen)
+        return seglen;
+    return n;
+}
+
+uint8_t load_page(void)
+{
+    uint8_t segs = (1024 + seglen - 1) / seglen;
+    uint16_t want = 0xFFFF >> (16 - segs);
+    uint16_t have = 0;
+    uint8_t n, s, t;
+    uint16_t i;
+
+    for (t=0;t<MAX_TRIES;t++)
+    {
+        for (s=0;s<segs;s++)
+        {
+            if (have & (1 << s))
+                continue;
+
+            n = seg_len(s);
+            txbuf[0] = 4 + n;
+            txbuf[2] = (caps & CAP_BURST_LOAD) ? CMD_BURST : CMD_LOAD;
+            txbuf[4] = s;
+            i = (uint16_t)s * seglen;
+            for (n=5;n<txbuf[0]+1;n++)
+                txbuf[n] = page[i++];
+
+            if (caps & CAP_BURST_LOAD)
+            {
+                tx_pkt();
+                // let the node store the segment and get back to RX
+                n = T3CNT;
+                while((uint8_t)(T3CNT - n) < 16);
+            }
+            else
+            {
+                if (0 != transact())
+                    return 1;
+                have |= 1 << s;
+            }
+        }
+
+        if (caps & CAP_BURST_LOAD)
+        {
+            if (0 != command(CMD_SEG_MAP, 0))
+                return 1;
+            have = radiobuf[3] | (radiobuf[4] << 8);
+        }
+        if ((have & want) == want)
+            return 0;
+        retries++;
+    }
+    return 1;
+}
+
+uint8_t read_page(uint8_t pg)
+{
+    uint8_t segs = (1024 + seglen - 1) / seglen;
+    uint8_t n, s;
+    uint16_t i;
+
+    for (s=0;s<segs;s++)
+    {
+        txbuf[0] = 4;
+        txbuf[2] = CMD_READ;
+        txbuf[3] = pg;
+        txbuf[4] = s;
+        if (0 != transact())
+            return 1;
+        i = (uint16_t)s * seglen;
+        for (n=0;n<seg_len(s);n++)
+            page[i++] = radiobuf[5 + n];
+    }
+    return 0;
+}
+
+// Check the node's copy of a page against the one in page[]
+uint8_t verify_page(uint8_t pg)
+{
+    uint16_t i;
+    uint8_t n, s;
+    uint8_t segs;
+
+    if (caps & CAP_PAGE_CRC)
+    {
+        if (0 != command(CMD_CRC, pg) || radiobuf[0] != 5)
+            return 1;
+        RNDL = 0xFF;
+        RNDL = 0xFF;
+        for (i=0;i<1024;i++)
+            RNDH = page[i];
+        return radiobuf[4] != RNDL || radiobuf[5] != RNDH;
+    }
+
+    segs = (1024 + seglen - 1) / seglen;
+    for (s=0;s<segs;s++)
+    {
+        txbuf[0] = 4;
+        txbuf[2] = CMD_READ;
+        txbuf[3] = pg;
+        txbuf[4] = s;
+        if (0 != transact())
+            return 1;
+        i = (uint16_t)s * seglen;
+        for (n=0;n<seg_len(s);n++)
+        {
+            if (radiobuf[5 + n] != page[i++])
+                return 1;
+        }
+    }
+    return 0;
+}
+
+// Load, erase, program and verify a whole page
+uint8_t write_page(uint8_t pg)
+{
+    uint8_t t;
+
+    for (t=0;t<PAGE_TRIES && connected;t++)
+    {
+        if (0 == load_page() &&
+            0 == command(CMD_ERASE, pg) &&
+            0 == command(CMD_PROGRAM, pg) &&
+            0 == verify_page(pg))
+            return 0;
+    }
+    return 1;
+}
+
+// Broadcast a page to the joined nodes, then fix up each of them in turn:
+// resend the segments it missed, and repeat erase and program, or the
+// whole page, for a node whose CRC does not match. Nodes which still fail
+// are dropped. Returns the nodes which have the page.
+uint8_t mcast_write_page(uint8_t pg)
+{
+    uint8_t segs = 1024 / seglen;
+    uint16_t want = 0xFFFF >> (16 - segs);
+    uint16_t have;
+    uint8_t n, s, t, k;
+    uint16_t i;
+
+    node = BROADCAST;
+    for (s=0;s<segs;s++)
+    {
+        txbuf[0] = 4 + seglen;
+        txbuf[2] = CMD_BURST;
+        txbuf[4] = s;
+        i = (uint16_t)s * seglen;
+        for (n=5;n<txbuf[0]+1;n++)
+            txbuf[n] = page[i++];
+        tx_pkt();
+        settle();
+    }
+
+    for (k=0;k<num_nodes;k++)
+    {
+        if (!(joined & (1 << k)))
+            continue;
+        node = nodes[k];
+        have = 0;
+        for (t=0;t<MAX_TRIES;t++)
+        {
+            if (0 != command(CMD_SEG_MAP, 0))
+                break;
+            have = radiobuf[3] | (radiobuf[4] << 8);
+            if ((have & want) == want)
+                break;
+            retries++;
+            for (s=0;s<segs;s++)
+            {
+                if (have & (1 << s))
+                    continue;
+                txbuf[0] = 4 + seglen;
+                txbuf[2] = CMD_BURST;
+                txbuf[4] = s;
+                i = (uint16_t)s * seglen;
+                for (n=5;n<txbuf[0]+1;n++)
+                    txbuf[n] = page[i++];
+                tx_pkt();
+                settle();
+            }
+        }
+        if ((have & want) != want)
+            joined &= ~(1 << k);
+    }
+
+    broadcast(CMD_ERASE, pg);
+    wait_ticks(FLASH_TIME);
+    broadcast(CMD_PROGRAM, pg);
+    wait_ticks(FLASH_TIME);
+
+    for (k=0;k<num_nodes;k++)
+    {
+        if (!(joined & (1 << k)))
+            continue;
+        node = nodes[k];
+        if (0 == verify_page(pg))
+            continue;
+        // missed the erase or program broadcast, page is still in its RAM
+        retries++;
+        if (0 == command(CMD_ERASE, pg) &&
+            0 == command(CMD_PROGRAM, pg) &&
+            0 == verify_page(pg))
+            continue;
+        if (0 != write_page(pg))
+            joined &= ~(1 << k);
+    }
+    return joined;
+}
+
+// A frame for a node which has gone, or garbage: answer it with an error,
+// as its command would have been, and drop the rest of it up to a gap of
+// at least 20ms on the line
+void resync(void)
+{
+    uint8_t quiet = 0;
+
+    cons_putc(1);
+    T3OVFIF = 0;
+    while(quiet < 2)
+    {
+        if (cons_ready())
+        {
+            cons_getc();
+            quiet = 0;
+        }
+        if (T3OVFIF)
+        {
+            T3OVFIF = 0;
+            quiet++;
+        }
+    }
+    rx_overrun = 0;
+}
+
+// Called once a frame has been read, before acting on it: if bytes were
+// lost on the way in, NAK the frame and drop what is left of it
+uint8_t overrun(void)
+{
+    if (!rx_overrun)
+        return 0;
+    resync();
+    return 1;
+}
+
+// Wake sleeping nodes running cctl_app_wor_listen(): packets back to back
+// for the given number of Timer 3 overflows, each with how many are left.
+// Nodes reset into cctl-rf on the last one and we go back to waiting for
+// their beacons. Anything from the host stops it early.
+void wake(void)
+{
+    uint16_t remaining;
+
+    node = cons_getc();
+    remaining = cons_getc();
+    remaining |= cons_getc() << 8;
+    if (remaining == 0 || node == BROADCAST || node == RELAY_ADDR)
+    {
+        resync();
+        return;
+    }
+
+    txbuf[0] = 4;
+    txbuf[2] = CMD_WAKE;
+    T3OVFIF = 0;
+    while(1)
+    {
+        txbuf[3] = remaining & 0xFF;
+        txbuf[4] = remaining >> 8;
+        tx_pkt();
+        if (cons_ready())
+            break;
+        if (T3OVFIF)
+        {
+            T3OVFIF = 0;
+            if (remaining-- == 0)
+                break;
+        }
+    }
+}
+
+// Answer a node's boot beacon, it enters upgrade mode on any packet
+void connect(void)
+{
+    if (radiobuf[1] != RELAY_ADDR || radiobuf[2] != CMD_BEACON)
+        return;
+
+    caps = 0;
+    seglen = 64;
+    node = 0xFE;
+    if (radiobuf[0] >= 5)
+    {
+        caps = radiobuf[3];
+        node = radiobuf[5];
+        if (caps & CAP_LARGE_SEGMENTS)
+            seglen = radiobuf[4] > SEGLEN_MAX ? SEGLEN_MAX : radiobuf[4];
+    }
+
+    // leave other nodes to the relays they belong to
+    if (node_filter && node != node_filter)
+        return;
+
+    txbuf[0] = 4;
+    txbuf[2] = CMD_BEACON;
+    txbuf[3] = seglen;
+    txbuf[4] = channel;
+    tx_pkt();
+
+    // the node moves as soon as it has the reply
+    if (caps & CAP_CHANNEL_SELECT)
+        radio_channel(channel);
+
+    connected = 1;
+    retries = 0;
+    lost = 0;
+    rate_max = 3;
+    if (0 == command(CMD_PING, 0))
+    {
+        cons_putc('W');
+        cons_putc('W');
+    }
+}
+
+// Answer the boot beacons of the nodes the host listed after 'm', keeping
+// the ones which have joined fed with pings, until all of them have or
+// JOIN_TIME has passed since the first. Nodes must all be able to take
+// broadcasts, and use 64 byte segments so that they share a bitmap.
+void mcast_join(void)
+{
+    uint8_t k;
+    uint8_t all;
+    uint8_t idle = 0;
+    uint8_t wait = 0;
+
+    num_nodes = cons_getc();
+    if (num_nodes > MAX_NODES)
+        num_nodes = MAX_NODES;
+    for (k=0;k<num_nodes;k++)
+        nodes[k] = cons_getc();
+    all = 0xFF >> (8 - num_nodes);
+    joined = 0;
+    caps = MCAST_CAPS | CAP_CHANNEL_SELECT;
+    seglen = 64;
+    if (num_nodes == 0)
+        return;
+
+    mcast = 1;
+    while(joined != all && (joined == 0 || wait < JOIN_TIME))
+    {
+        if (rx_pkt() && radiobuf[1] == RELAY_ADDR && radiobuf[2] == CMD_BEACON && radiobuf[0] >= 5)
+        {
+            for (k=0;k<num_nodes;k++)
+            {
+                if (radiobuf[5] != nodes[k] || (joined & (1 << k)))
+                    continue;
+                if ((radiobuf[3] & MCAST_CAPS) != MCAST_CAPS)
+                    break;
+                // all nodes have to stay on the same channel
+                if (joined && ((radiobuf[3] ^ caps) & CAP_CHANNEL_SELECT))
+                    break;
+                caps &= radiobuf[3];
+                node = nodes[k];
+                txbuf[0] = 4;
+                txbuf[2] = CMD_BEACON;
+                txbuf[3] = seglen;
+                txbuf[4] = channel;
+                tx_pkt();
+                joined |= 1 << k;
+                break;
+            }
+        }
+        if (T3OVFIF)
+        {
+            T3OVFIF = 0;
+            if (joined)
+                wait++;
+            if (++idle == KEEPALIVE)
+            {
+                idle = 0;
+                if (joined && (caps & CAP_CHANNEL_SELECT))
+                {
+                    // joined nodes are on the update channel
+                    radio_channel(channel);
+                    broadcast(CMD_PING, seglen);
+                    radio_channel(BOOT_CHANNEL);
+                }
+                else if (joined)
+                    broadcast(CMD_PING, seglen);
+            }
+        }
+    }
+
+    if (caps & CAP_CHANNEL_SELECT)
+        radio_channel(channel);
+
+    // check every node made it through the handshake, including any which
+    // took a broadcast ping as its answer
+    joined = 0;
+    for (k=0;k<num_nodes;k++)
+    {
+        node = nodes[k];
+        txbuf[0] = 4;
+        txbuf[2] = CMD_PING;
+        txbuf[3] = seglen;
+        txbuf[4] = channel;
+        if (0 == transact())
+            joined |= 1 << k;
+    }
+
+    if (joined == 0)
+    {
+        disconnect();
+        return;
+    }
+
+    connected = 1;
+    retries = 0;
+    cons_putc('W');
+    cons_putc('W');
+}
+
+void main(void)
+{
+    uint8_t cmd, pg, rc;
+    uint8_t idle = 0;
+    uint16_t i;
+
+    // select external crystal, the radio needs it
+    CLKCON = CLKCON_OSC32 | TICKSPD_DIV_32 | CLKSPD_DIV_1;
+    while (CLKCON & CLKCON_OSC);
+    SLEEP |= SLEEP_OSC_PD;
+
+    T3CTL = 0xD4;   // tick/64, free running, overflows every 20ms
+
+    radio_init();
+
+    URX0IF = 0;
+    URX0IE = 1;
+    EA = 1;
+
+    while(1)
+    {
+        if (!connected)
+        {
+            if (rx_pkt())
+                connect();
+            if (cons_ready())
+            {
+                cmd = cons_getc();
+                if (cmd == 'w')
+                    wake();
+                else if (cmd == 'm')
+                    mcast_join();
+                else if (cmd == 'c')
+                {
+                    // channel for updates and the node to take
+                    channel = cons_getc();
+                    node_filter = cons_getc();
+                }
+                else
+                {
+                    // a relay with no node can be reflashed with "+++",
+                    // anything else is a frame meant for a node
+                    cctl_app_rx(cmd);
+                    if (cmd != '+')
+                        resync();
+                }
+            }
+            continue;
+        }
+
+        if (!cons_ready())
+        {
+            if (T3OVFIF)
+            {
+                T3OVFIF = 0;
+                if (++idle >= (rate == RATE_DEFAULT ? KEEPALIVE : RATE_KEEPALIVE))
+                {
+                    // keep the node's 1s watchdog fed, and at our rate
+                    idle = 0;
+                    if (mcast)
+                        broadcast(CMD_PING, seglen);
+                    else
+                        rate_adjust();
+                }
+            }
+            continue;
+        }
+        idle = 0;
+
+        // cctl's serial commands, each answered with 0 or 1
+        cmd = cons_getc();
+        switch(cmd)
+        {
+            case 'l':
+                for (i=0;i<1024;i++)
+                    page[i] = cons_getc();
+                if (overrun())
+                    break;
+                cons_putc(load_page());
+                break;
+            case 'e':
+                pg = cons_getc();
+                if (overrun())
+                    break;
+                if (mcast)
+                {
+                    broadcast(CMD_ERASE, pg);
+                    wait_ticks(FLASH_TIME);
+                    cons_putc(0);
+                }
+                else
+                    cons_putc(command(CMD_ERASE, pg));
+                break;
+            case 'p':
+                pg = cons_getc();
+                if (overrun())
+                    break;
+                cons_putc(command(CMD_PROGRAM, pg));
+                break;
+            case 'r':
+                pg = cons_getc();
+                if (overrun())
+                    break;
+                rc = read_page(pg);
+                for (i=0;i<1024;i++)
+                    cons_putc(page[i]);
+                cons_putc(rc);
+                break;
+            case 'j':
+                if (mcast)
+                    node = BROADCAST;
+                txbuf[0] = 4;
+                txbuf[2] = CMD_JUMP;
+                tx_pkt();
+                disconnect();
+                break;
+            case 'N':
+                // nodes still in a multicast update, bit per 'm' entry
+                cons_putc(joined);
+                break;
+            case 'M':
+                // page number and 1024 bytes for every node, answered with
+                // the nodes which have it and the radio retries it took
+                pg = cons_getc();
+                for (i=0;i<1024;i++)
+                    page[i] = cons_getc();
+                if (overrun())
+                    break;
+                retries = 0;
+                cons_putc(mcast ? mcast_write_page(pg) : 0);
+                cons_putc(retries & 0xFF);
+                cons_putc(retries >> 8);
+                break;
+            case 'i':
+                // relay info, tells cctl-prog it can send 'W' frames
+                cons_putc(caps);
+                cons_putc(seglen);
+                cons_putc(node);
+                break;
+            case 'W':
+                // page number and 1024 bytes, answered with the status
+                // and the number of radio retries it took
+                pg = cons_getc();
+                for (i=0;i<1024;i++)
+                    page[i] = cons_getc();
+                if (overrun())
+                    break;
+                retries = 0;
+                rc = write_page(pg);
+                // before answering, the host sends its next frame as soon
+                // as it has the answer
+                if (connected)
+                    rate_adjust();
+                cons_putc(rc);
+                cons_putc(retries & 0xFF);
+                cons_putc(retries >> 8);
+                break;
+            case 0x00:
+                // sent by cctl-prog after the "WW" handshake, no answer
+                break;
+            default:
+                // not a command, or the start of a frame was lost
+                resync();
+                break;
+        }
+    }
+}
@@ -0,0 +1,100 @@
+/*
+ * CCTL application support
+ * Lets an application running behind CCTL reset into upgrade mode
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include <stdint.h>
+#include <cc1110.h>
+#include "cc1110-ext.h"
+#include "cctl.h"
+#include "cctl-app.h"
+
+// Sent back to back by ccrl, with the number of 20ms periods left
+#define WAKE_CMD 0x11
+#define WAKE_PKT_LEN 4
+
+static uint8_t plus_count;
+
+void cctl_app_rx(uint8_t ch)
+{
+    if (ch != '+')
+    {
+        plus_count = 0;
+        return;
+    }
+    if (++plus_count == 3)
+        cctl_app_enter_bootloader();
+}
+
+void cctl_app_enter_bootloader(void)
+{
+    EA = 0;
+
+    // SRAM survives the watchdog reset, the bootloader clears the flag
+    CCTL_BOOT_REQUEST = CCTL_BOOT_REQUEST_MAGIC;
+
+    WDCTL = WDCTL_EN | WDCTL_INT3_MSEC_2;
+    while(1);
+}
+
+
+// Receive n bytes by polling RFD, fails once the radio has gone idle
+static uint8_t rf_read(__data uint8_t *p, uint8_t n)
+{
+    while(n--)
+    {
+        while(!RFTXRXIF)
+        {
+            if (MARCSTATE == MARC_STATE_IDLE)
+                return 1;
+        }
+        RFTXRXIF = 0;
+        *p++ = RFD;
+    }
+    return 0;
+}
+
+void cctl_app_wor_listen(uint8_t rx_time)
+{
+    // length, address, command, 2 bytes of count, RSSI, LQI/CRC
+    uint8_t pkt[WAKE_PKT_LEN + 3];
+    uint8_t mcsm2 = MCSM2;
+
+    // RX_TIME_QUAL: keep listening past rx_time only if a preamble is heard
+    MCSM2 = 0x08 | (rx_time & 0x07);
+
+    while(1)
+    {
+        RFTXRXIF = 0;
+        RFST = RFST_SRX;
+        while(MARCSTATE != MARC_STATE_RX);
+
+        if (0 != rf_read(pkt, sizeof(pkt)) ||
+            pkt[0] != WAKE_PKT_LEN ||
+            pkt[2] != WAKE_CMD ||
+            !(pkt[6] & 0x80))
+            break;
+
+        // reset during the last period, cctl-rf beacons as the relay
+        // starts listening
+        if (pkt[3] == 0 && pkt[4] == 0)
+            cctl_app_enter_bootloader();
+    }
+
+    RFST = RFST_SIDLE;
+    while(MARCSTATE != MARC_STATE_IDLE);
+    MCSM2 = mcsm2;
+}
@@ -0,0 +1,40 @@
+/*
+ * CCTL application support
+ * Lets an application running behind CCTL reset into upgrade mode
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#ifndef CCTL_APP_H
+#define CCTL_APP_H 1
+
+#include <stdint.h>
+
+// Call from the application's UART receive ISR with every byte. On the
+// "+++" which cctl-prog sends, resets into the bootloader's upgrade mode.
+extern void cctl_app_rx(uint8_t ch);
+
+// Reset into the bootloader's upgrade mode, does not return
+extern void cctl_app_enter_bootloader(void);
+
+// Wake-on-radio rendezvous for applications on cctl-rf nodes, with the
+// radio set up as cctl-rf leaves it. Call on every Event 0 wake-up from
+// the sleep timer: the radio listens for rx_time (MCSM2.RX_TIME, a
+// fraction of the Event 0 period) and stays on only if it hears a
+// preamble. If the relay is sending wake-up packets, waits for the end of
+// the burst and resets into cctl-rf, otherwise returns with the radio idle.
+extern void cctl_app_wor_listen(uint8_t rx_time);
+
+#endif
+
@@ -16,6 +16,7 @@
 #ifndef WIN32
 #include <termios.h>
 #include <sys/select.h>
+#include <sys/wait.h>
 #else
 #include <windows.h>
 #include <wincon.h>
@@ -24,6 +25,25 @@
 #endif
 
 #include "hex.h"
+#include "crc.h"
+
+// Layout used by cctl built with DUAL_SLOT
+#define SLOT_A_START 0x0400
+#define SLOT_B_START 0x4000
+#define SLOT_SIZE 0x3C00
+#define SLOT_HEADER_SIZE 8
+#define SLOT_MAGIC 0x4C54
+
+// Reported by cchl in reply to 'i'
+#define CCHL_PAGE_ERASE 0x01
+#define CCHL_CRC 0x02
+#define CCHL_GANG 0x04
+#define CCHL_MULTI_PAGE 0x08
+#define MAX_TARGETS 8
+#define CCHL_MAX_PAGES 3        // page buffers in the slave's RAM
+
+// Relays which can be driven at once with -w, one process each
+#define MAX_RELAYS 8
 
 static struct option long_options[] =
 {
@@ -34,6 +54,13 @@ static struct option long_options[] =
     {"timeout",     required_argument, 0, 't'},
     {"passthrough",    no_argument, 0, 'p'},
     {"wireless",    no_argument, 0, 'w'},
+    {"stage1",     required_argument, 0, 's'},
+    {"dual-slot",    no_argument, 0, 'b'},
+    {"wake",     required_argument, 0, 'k'},
+    {"node",     required_argument, 0, 'n'},
+    {"channel",     required_argument, 0, 'C'},
+    {"pages",     required_argument, 0, 'P'},
+    {"multicast",    no_argument, 0, 'm'},
     {0, 0, 0, 0}
 };
 
@@ -51,6 +78,15 @@ void usage(void)
     fprintf(stderr, "  --timeout=n      -t n        Search for bootload string for n seconds\n");
     fprintf(stderr, "  --passthrough    -p          Program remote device over passthrough\n");
     fprintf(stderr, "  --wireless       -w          Program remote device over wireless ccrl\n");
+    fprintf(stderr, "  --stage1=s1.hex  -s s1.hex   Start your own stage-1 loader from RAM first (not -p/-w)\n");
+    fprintf(stderr, "  --dual-slot      -b          Stage update in slot B of a DUAL_SLOT cctl\n");
+    fprintf(stderr, "  --wake=n         -k n        Wake a node which sleeps for up to n seconds (-w)\n");
+    fprintf(stderr, "  --node=addr      -n addr     Radio address of the node to update, hex (FE)\n");
+    fprintf(stderr, "  --channel=n      -C n        Radio channel for the update (-w)\n");
+    fprintf(stderr, "  --pages=a-b      -P a-b      Only erase and program pages a to b\n");
+    fprintf(stderr, "  --multicast      -m          Update all the -n nodes together through one relay (-w)\n");
+    fprintf(stderr, "With -w, -d, -n and -C take comma separated lists to update one node per\n");
+    fprintf(stderr, "relay in parallel, by default on channels 4, 8, 12...\n");
 }
 
 static bool opt_console = false;
@@ -59,22 +95,55 @@ static int opt_timeout = 10;
 static bool opt_device = false;
 static char *flash_filename = NULL;
 static char *device_name = NULL;
+static char *stage1_filename = NULL;
 static bool opt_passthrough = 0;
 static bool opt_wireless = 0;
+static bool opt_dual_slot = false;
+static int opt_wake = 0;
+static uint8_t opt_node = 0xFE;
+static bool opt_node_given = false;
+static int opt_channel = -1;
+static char *device_names[MAX_RELAYS];
+static int num_devices = 0;
+static uint8_t relay_nodes[MAX_RELAYS];
+static int num_nodes = 0;
+static int relay_channels[MAX_RELAYS];
+static int num_channels = 0;
 static int serial_timeout = 2;
+static uint8_t cchl_caps = 0;
+static int gang_targets = 1;        // slaves programmed in lockstep by cchl
+static unsigned int gang_failed = 0;    // bit per target
+static int opt_first_page = -1;
+static int opt_last_page = -1;
+static bool relay_batched = false;  // ccrl takes whole pages with 'W'
+static unsigned long relay_retries = 0;
+static bool opt_multicast = false;
 
 #ifndef WIN32
 static struct termios orig_termios;
 #endif
 
+// Split a comma separated option in place
+static int split_list(char *s, char **list)
+{
+    int n = 0;
+    char *tok;
+
+    for (tok=strtok(s, ",");tok && n < MAX_RELAYS;tok=strtok(NULL, ","))
+        list[n++] = tok;
+    return n;
+}
+
 int parse_options(int argc, char **argv)
 {
     int c;
     int option_index;
+    char *list[MAX_RELAYS];
+    int i;
 
     while(1)
     {
-        c = getopt_long (argc, argv, "hcf:d:t:p:w", long_options, &option_index);
+        c = getopt_long (argc, argv, "hcf:d:t:pws:bk:n:C:P:m", long_options, &option_index);
         if (c == -1)
             break;
         switch(c)
@@ -101,7 +170,37 @@ int parse_options(int argc, char **argv)
             break;
             case 'd':
                 opt_device = true;
-                device_name = strdup(optarg);
+                num_devices = split_list(strdup(optarg), device_names);
+                device_name = device_names[0];
+            break;
+            case 's':
+                stage1_filename = strdup(optarg);
+            break;
+            case 'b':
+                opt_dual_slot = true;
+            break;
+            case 'k':
+                opt_wake = atoi(optarg);
+            break;
+            case 'n':
+                num_nodes = split_list(strdup(optarg), list);
+                for (i=0;i<num_nodes;i++)
+                    relay_nodes[i] = strtoul(list[i], NULL, 16);
+                opt_node = relay_nodes[0];
+                opt_node_given = true;
+            break;
+            case 'C':
+                num_channels = split_list(strdup(optarg), list);
+                for (i=0;i<num_channels;i++)
+                    relay_channels[i] = atoi(list[i]);
+                opt_channel = relay_channels[0];
+            break;
+            case 'P':
+                if (2 != sscanf(optarg, "%d-%d", &opt_first_page, &opt_last_page))
+                    return 1;
+            break;
+            case 'm':
+                opt_multicast = true;
             break;
             default:
                 return 1;
@@ -115,6 +214,44 @@ int parse_options(int argc, char **argv)
     if (!opt_flash && !opt_console)
         return 1;
 
+    if (opt_wake && !opt_wireless)
+        return 1;
+
+    // stage-1 replaces cctl itself, relays and cchl have no 'x'
+    if (stage1_filename && (opt_passthrough || opt_wireless || !opt_flash))
+        return 1;
+
+    if (num_devices < 1)
+        return 1;
+
+    // one relay updates every node listed with -n
+    if (opt_multicast)
+    {
+        if (!opt_wireless || !opt_flash || opt_console)
+            return 1;
+        if (num_devices != 1 || num_nodes < 1 || num_channels > 1)
+            return 1;
+        if (opt_wake || opt_dual_slot || stage1_filename)
+            return 1;
+        return 0;
+    }
+
+    // several relays each update their own node, on their own channel
+    if (num_devices > 1)
+    {
+#ifdef WIN32
+        return 1;
+#endif
+        if (!opt_wireless || !opt_flash || opt_console)
+            return 1;
+        if (num_nodes != num_devices)
+            return 1;
+        if (num_channels != 0 && num_channels != num_devices)
+            return 1;
+        for (i=0;num_channels==0 && i<num_devices;i++)
+            relay_channels[i] = (i + 1) * 4;
+    }
+
     return 0;
 }
 
@@ -251,24 +388,20 @@ int serialRead(int fd, void* buf, int len)
         return bread;
 }
 #else
+// Waits up to serial_timeout seconds, returns 0 if nothing arrived
 int serialRead(int fd, void* buf, int len)
 {
-    struct timeval start, now;
+    struct timeval tv;
+    fd_set rfds;
     int rc;
 
-    gettimeofday(&start, NULL);
-
-    do
-    {
-        if ((rc = read(fd, buf, len)) < 0)
-            return rc;
-        if (rc > 0)
-            return rc;
-        gettimeofday(&now, NULL);
-    }
-    while((now.tv_sec - start.tv_sec) < serial_timeout);
-
-    return 1;
+    tv.tv_sec = serial_timeout;
+    tv.tv_usec = 0;
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    if ((rc = select(fd + 1, &rfds, NULL, NULL, &tv)) <= 0)
+        return rc;
+    return read(fd, buf, len);
 }
 #endif
 
@@ -287,24 +420,20 @@ int serialWrite(int fd, const void* buf, int len)
         return bwritten;
 }
 #else
+// Waits up to serial_timeout seconds, returns 0 if nothing was written
 int serialWrite(int fd, void* buf, int len)
 {
-    struct timeval start, now;
+    struct timeval tv;
+    fd_set wfds;
     int rc;
 
-    gettimeofday(&start, NULL);
-
-    do
-    {
-        if ((rc = write(fd, buf, len)) < 0)
-            return rc;
-        if (rc > 0)
-            return rc;
-        gettimeofday(&now, NULL);
-    }
-    while((now.tv_sec - start.tv_sec) < serial_timeout);
-
-    return 1;
+    tv.tv_sec = serial_timeout;
+    tv.tv_usec = 0;
+    FD_ZERO(&wfds);
+    FD_SET(fd, &wfds);
+    if ((rc = select(fd + 1, NULL, &wfds, NULL, &tv)) <= 0)
+        return rc;
+    return write(fd, buf, len);
 }
 #endif
 
@@ -319,6 +448,17 @@ int serialClose(int fd)
 #define serialClose close
 #endif
 
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
 int program_page(int fd, int page)
 {
     char cmd = 'p';
@@ -364,13 +504,15 @@ int read_page(int fd, uint8_t page, uint8_t *data)
     return 0;
 }
 
-static int already_erased = 0;  // passthrough programmer only supports mass erase
+static int already_erased = 0;  // older cchl builds only support mass erase
 int erase_page(int fd, uint8_t page)
 {
     char cmd = 'e';
     char rsp;
 
-    if (already_erased && opt_passthrough)
+    if (opt_passthrough && (cchl_caps & CCHL_PAGE_ERASE))
+        cmd = 'E';
+    else if (already_erased && opt_passthrough)
         return 0;
 
     if (serialWrite(fd, &cmd, 1) <= 0)
@@ -422,6 +564,129 @@ void dump(uint8_t *p, size_t len)
     printf("\n");
 }
 
+// CRC16 of count pages, calculated on the slave by cchl, one per target
+// in gang mode
+int page_crc(int fd, uint8_t page, uint8_t count, uint16_t *crc)
+{
+    uint8_t cmd[3];
+    uint8_t rsp[MAX_TARGETS * 2 + 2];
+    int len = gang_targets * 2 + 1;
+    int remaining;
+    int rc;
+    int t;
+
+    // a gang cchl adds the targets which timed out
+    if (cchl_caps & CCHL_GANG)
+        len++;
+
+    cmd[0] = 'c';
+    cmd[1] = page;
+    cmd[2] = count;
+    if (serialWrite(fd, cmd, 3) != 3)
+        return 1;
+
+    remaining = len;
+    while(remaining > 0)
+    {
+        rc = serialRead(fd, rsp + (len - remaining), remaining);
+        if (rc <= 0)
+            return 1;
+        remaining -= rc;
+    }
+
+    if (rsp[len - 1] != 0)
+        return 1;
+
+    for (t=0;t<gang_targets;t++)
+    {
+        crc[t] = get_le16(rsp + t * 2);
+        if ((cchl_caps & CCHL_GANG) && (rsp[gang_targets * 2] & (1 << t)) && !(gang_failed & (1 << t)))
+        {
+            fprintf(stderr, "target %d: timed out\n", t);
+            gang_failed |= 1 << t;
+        }
+    }
+    return 0;
+}
+
+// Compare the page CRC from each slave with the image, in gang mode carry
+// on for as long as any target is good
+static int verify_page_crc(int fd, uint8_t *data, uint8_t page)
+{
+    uint16_t crc[MAX_TARGETS];
+    uint16_t expected;
+    int t;
+
+    if (0 != page_crc(fd, page, 1, crc))
+    {
+        fprintf(stderr, "page_crc failed\n");
+        return 1;
+    }
+    expected = crc16(0xFFFF, data, 1024);
+    for (t=0;t<gang_targets;t++)
+    {
+        if (crc[t] != expected && !(gang_failed & (1 << t)))
+        {
+            fprintf(stderr, "target %d: verify failed, crc %04X expected %04X\n", t, crc[t], expected);
+            gang_failed |= 1 << t;
+        }
+    }
+    return gang_failed == (1u << gang_targets) - 1;
+}
+
+// Load up to CCHL_MAX_PAGES pages into the slave's RAM and have cchl
+// erase and program them all with one resume of the slave
+int cchl_write_pages(int fd, uint8_t *data, uint8_t page, int count)
+{
+    uint8_t cmd[3];
+    uint8_t rsp;
+    int remaining;
+    int rc;
+    int n;
+
+    for (n=0;n<count;n++)
+    {
+        cmd[0] = 'L';
+        cmd[1] = n;
+        if (serialWrite(fd, cmd, 2) != 2)
+            return 1;
+
+        remaining = 1024;
+        while(remaining > 0)
+        {
+            rc = serialWrite(fd, data + n * 1024 + (1024 - remaining), remaining);
+            if (rc <= 0)
+                return 1;
+            remaining -= rc;
+        }
+
+        if (serialRead(fd, &rsp, 1) <= 0 || rsp != 0)
+        {
+            fprintf(stderr, "load failed\n");
+            return 1;
+        }
+    }
+
+    cmd[0] = 'P';
+    cmd[1] = page;
+    cmd[2] = count;
+    if (serialWrite(fd, cmd, 3) != 3)
+        return 1;
+    if (serialRead(fd, &rsp, 1) <= 0 || rsp != 0)
+    {
+        fprintf(stderr, "program failed\n");
+        return 1;
+    }
+
+    for (n=0;n<count;n++)
+    {
+        if (0 != verify_page_crc(fd, data + n * 1024, page + n))
+            return 1;
+    }
+
+    return 0;
+}
+
 int erase_program_verify_page(int fd, uint8_t *data, uint8_t page)
 {
     uint8_t verbuf[1024];
@@ -444,6 +709,9 @@ int erase_program_verify_page(int fd, uint8_t *data, uint8_t page)
         return 1;
     }
 
+    if (opt_passthrough && (cchl_caps & CCHL_CRC))
+        return verify_page_crc(fd, data, page);
+
     if (0 != read_page(fd, page, verbuf))
     {
         fprintf(stderr, "read_page failed\n");
@@ -465,6 +733,77 @@ int erase_program_verify_page(int fd, uint8_t *data, uint8_t page)
     return 0;
 }
 
+// Newer cchl builds answer 'i' with what they support, older ones can
+// only erase the whole chip
+int cchl_info(int fd)
+{
+    uint8_t cmd = 'i';
+    int saved_timeout = serial_timeout;
+    int rc;
+
+    if (serialWrite(fd, &cmd, 1) <= 0)
+        return 1;
+
+    serial_timeout = 1;
+    rc = serialRead(fd, &cchl_caps, 1);
+    serial_timeout = saved_timeout;
+
+    if (rc != 1)
+    {
+        cchl_caps = 0;
+        return 1;
+    }
+
+    if (cchl_caps & CCHL_GANG)
+    {
+        serial_timeout = 1;
+        rc = serialRead(fd, &cmd, 1);
+        serial_timeout = saved_timeout;
+        if (rc != 1 || cmd < 1 || cmd > MAX_TARGETS)
+            return 1;
+        gang_targets = cmd;
+        printf("Passthrough: %d targets\n", gang_targets);
+    }
+
+    printf("Passthrough: caps %02X\n", cchl_caps);
+    return 0;
+}
+
+// Tell a ccrl which node to take and which channel to move it to once
+// it has answered its boot packets
+int relay_select(int fd, int channel, uint8_t node)
+{
+    uint8_t cmd[3];
+
+    cmd[0] = 'c';
+    cmd[1] = channel;
+    cmd[2] = node;
+    if (serialWrite(fd, cmd, 3) != 3)
+        return 1;
+    return 0;
+}
+
+// Have the relay send wake-up packets for longer than the node sleeps,
+// the node resets into cctl-rf at the end of them
+int wake_node(int fd, uint8_t node, int secs)
+{
+    uint8_t cmd[4];
+    int periods = secs * 50;    // 20ms each
+
+    if (periods > 0xFFFF)
+        periods = 0xFFFF;
+
+    cmd[0] = 'w';
+    cmd[1] = node;
+    cmd[2] = periods & 0xFF;
+    cmd[3] = periods >> 8;
+    if (serialWrite(fd, cmd, 4) != 4)
+        return 1;
+
+    printf("Waking node %02X for %ds\n", node, secs);
+    return 0;
+}
+
 int wait_for_bootloader(int fd, int timeout)
 {
     uint8_t c = 0;
@@ -476,7 +815,7 @@ int wait_for_bootloader(int fd, int timeout)
     gettimeofday(&start, NULL);
 
     if (!opt_passthrough && !opt_wireless)
-        serialWrite(fd, "+++", 5);
+        serialWrite(fd, "+++", 3);
 
     printf("Waiting %ds for bootloader, reset board now\n", timeout);
 
@@ -527,6 +866,226 @@ int wait_for_bootloader(int fd, int timeout)
     return 0;
 }
 
+// Upload and start a stage-1 loader, which then takes the same page
+// commands as cctl. None ships with cctl-prog, this is a hook for one.
+int run_stage1(int fd, const char *filename)
+{
+    uint8_t *image;
+    uint16_t sum = 0;
+    uint8_t cmd[3];
+    char rsp;
+    int i;
+
+    // stage-1 is linked to run from rambuf at 0xF000
+    if (NULL == (image = malloc(64*1024)))
+        return 1;
+    memset(image, 0xFF, 64*1024);
+    if (0 != read_hexfile(image, 64*1024, filename))
+    {
+        fprintf(stderr, "Failed to read %s\n", filename);
+        free(image);
+        return 1;
+    }
+
+    for (i=0;i<1024;i++)
+        sum += image[0xF000 + i];
+
+    if (0 != load_data(fd, image + 0xF000))
+    {
+        fprintf(stderr, "load_data failed\n");
+        free(image);
+        return 1;
+    }
+    free(image);
+
+    cmd[0] = 'x';
+    cmd[1] = sum & 0xFF;
+    cmd[2] = sum >> 8;
+    if (serialWrite(fd, cmd, 3) != 3)
+        return 1;
+
+    if (serialRead(fd, &rsp, 1) <= 0 || rsp != 0)
+    {
+        fprintf(stderr, "stage-1 checksum rejected\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// A ccrl built from source answers 'i' with what it learnt from the
+// node's beacon, the older prebuilt relays stay silent
+int relay_info(int fd)
+{
+    uint8_t cmd = 'i';
+    uint8_t info[3];
+    int saved_timeout = serial_timeout;
+    int got = 0;
+    int rc;
+
+    if (serialWrite(fd, &cmd, 1) <= 0)
+        return 1;
+
+    // a relay which answers sends exactly 3 bytes
+    serial_timeout = 1;
+    while(got < 3)
+    {
+        rc = serialRead(fd, info + got, 3 - got);
+        if (rc <= 0)
+            break;
+        got += rc;
+    }
+    serial_timeout = 0;
+    if (got == 3 && serialRead(fd, &cmd, 1) != 0)
+        got = 0;
+    serial_timeout = saved_timeout;
+
+    if (got != 3)
+        return 1;
+
+    printf("Relay: node %02X, caps %02X, %d byte segments\n", info[2], info[0], info[1]);
+    return 0;
+}
+
+// Send a page in one frame, the relay loads, erases, programs and
+// verifies it over the radio and reports how many retries it needed
+int relay_write_page(int fd, uint8_t *data, uint8_t page)
+{
+    uint8_t cmd[2];
+    uint8_t rsp[3];
+    int saved_timeout = serial_timeout;
+    int remaining;
+    int rc;
+
+    cmd[0] = 'W';
+    cmd[1] = page;
+    if (serialWrite(fd, cmd, 2) != 2)
+        return 1;
+
+    remaining = 1024;
+    while(remaining > 0)
+    {
+        rc = serialWrite(fd, data + (1024 - remaining), remaining);
+        if (rc <= 0)
+            return 1;
+        remaining -= rc;
+    }
+
+    // the relay retries on its own, give it time to
+    serial_timeout = 30;
+    remaining = 3;
+    while(remaining > 0)
+    {
+        rc = serialRead(fd, rsp + (3 - remaining), remaining);
+        if (rc <= 0)
+            break;
+        remaining -= rc;
+    }
+    serial_timeout = saved_timeout;
+
+    if (remaining > 0)
+        return 1;
+
+    relay_retries += get_le16(rsp + 1);
+    if (get_le16(rsp + 1) > 0)
+        printf("  %d radio retries\n", get_le16(rsp + 1));
+
+    return rsp[0] != 0;
+}
+
+// Send a page to every node in a multicast update, the relay answers with
+// the nodes which have it, a bit per -n entry, and its radio retries
+int relay_mcast_page(int fd, uint8_t *data, uint8_t page, uint8_t *ok)
+{
+    uint8_t cmd[2];
+    uint8_t rsp[3];
+    int saved_timeout = serial_timeout;
+    int remaining;
+    int rc;
+
+    cmd[0] = 'M';
+    cmd[1] = page;
+    if (serialWrite(fd, cmd, 2) != 2)
+        return 1;
+
+    remaining = 1024;
+    while(remaining > 0)
+    {
+        rc = serialWrite(fd, data + (1024 - remaining), remaining);
+        if (rc <= 0)
+            return 1;
+        remaining -= rc;
+    }
+
+    // every node may need fixing up in turn
+    serial_timeout = 30 * num_nodes;
+    remaining = 3;
+    while(remaining > 0)
+    {
+        rc = serialRead(fd, rsp + (3 - remaining), remaining);
+        if (rc <= 0)
+            break;
+        remaining -= rc;
+    }
+    serial_timeout = saved_timeout;
+
+    if (remaining > 0)
+        return 1;
+
+    *ok = rsp[0];
+    relay_retries += get_le16(rsp + 1);
+    if (get_le16(rsp + 1) > 0)
+        printf("  %d radio retries\n", get_le16(rsp + 1));
+
+    return 0;
+}
+
+// Move an image linked at 0x400 into slot B and add a header with a
+// version newer than whatever is in slot A. The bootloader copies it
+// over slot A on the next boot once it has checked the CRC.
+int prepare_slot_image(int fd, uint8_t *buf)
+{
+    uint8_t page[1024];
+    uint8_t *hdr;
+    uint16_t version = 1;
+    int len;
+    int i;
+
+    for (i=SLOT_A_START + SLOT_SIZE - SLOT_HEADER_SIZE;i<32*1024;i++)
+    {
+        if (buf[i] != 0xFF)
+        {
+            fprintf(stderr, "image does not fit in a slot\n");
+            return 1;
+        }
+    }
+
+    len = SLOT_SIZE - SLOT_HEADER_SIZE;
+    while(len > 0 && buf[SLOT_A_START + len - 1] == 0xFF)
+        len--;
+
+    if (0 != read_page(fd, (SLOT_A_START + SLOT_SIZE) / 1024 - 1, page))
+    {
+        fprintf(stderr, "read_page failed\n");
+        return 1;
+    }
+    hdr = page + 1024 - SLOT_HEADER_SIZE;
+    if (get_le16(hdr) == SLOT_MAGIC)
+        version = get_le16(hdr + 2) + 1;
+
+    memcpy(buf + SLOT_B_START, buf + SLOT_A_START, SLOT_SIZE);
+    memset(buf + SLOT_A_START, 0xFF, SLOT_SIZE);
+
+    hdr = buf + SLOT_B_START + SLOT_SIZE - SLOT_HEADER_SIZE;
+    put_le16(hdr, SLOT_MAGIC);
+    put_le16(hdr + 2, version);
+    put_le16(hdr + 4, len);
+    put_le16(hdr + 6, crc16(0xFFFF, buf + SLOT_B_START, len));
+
+    printf("Staging version %d, %d bytes in slot B\n", version, len);
+    return 0;
+}
+
 int send_jump(int fd)
 {
     uint8_t cmd = 'j';
@@ -787,88 +1346,358 @@ void do_console(int fd)
 #endif
 
 
-int main(int argc, char *argv[])
+static bool page_empty(const uint8_t *p)
 {
-    int fd;
-    uint8_t *buf;
-    int i, j;
+    int j;
 
-    if (NULL == (buf=malloc(32*1024)))
+    for (j=0;j<1024;j++)
     {
-        fprintf(stderr, "out of ram\n");
-        return 1;
-    }   
+        if (p[j] != 0xFF)
+            return false;
+    }
+    return true;
+}
 
-    if (0 != parse_options(argc, argv))
+int flash_device(int fd, uint8_t *buf)
+{
+    struct timeval start_time, now;
+    long ms;
+    int i;
+    int rc;
+    int start = 0x400;
+    int end = 32*1024;
+
+    if (opt_wireless && (opt_channel >= 0 || opt_node_given))
     {
-        usage();
+        if (0 != relay_select(fd, opt_channel < 0 ? 0 : opt_channel, opt_node_given ? opt_node : 0))
+        {
+            fprintf(stderr, "Failed to set up relay\n");
+            return 1;
+        }
+    }
+
+    if (opt_wake && 0 != wake_node(fd, opt_node, opt_wake))
+    {
+        fprintf(stderr, "Failed to send wake-up\n");
         return 1;
     }
 
-    if ((fd = serialOpen(device_name)) < 0)
+    if (0 != wait_for_bootloader(fd, opt_timeout + opt_wake))
     {
-        fprintf(stderr, "Failed to open %s\n", device_name);
+        fprintf(stderr, "No bootloader detected\n");
         return 1;
     }
+    else
+    {
+        printf("Bootloader detected\n");
+    }
+    gettimeofday(&start_time, NULL);
 
-    if (opt_flash)
+    if (stage1_filename)
     {
-        memset(buf, 0xFF, 32*1024);
-        if (0 != read_hexfile(buf, 32*1024, flash_filename))
+        if (0 != run_stage1(fd, stage1_filename))
         {
-            fprintf(stderr, "Failed to read %s\n", flash_filename);
+            fprintf(stderr, "Failed to start stage-1 loader\n");
             return 1;
         }
+        printf("Stage-1 loader running\n");
+    }
 
-        if (0 != wait_for_bootloader(fd, opt_timeout))
-        {
-            fprintf(stderr, "No bootloader detected\n");
+    if (opt_wireless && 0 == relay_info(fd))
+        relay_batched = true;
+
+    // the debug interface can write page 0 as well, but it holds the
+    // slave's bootloader: only touch it when the image has one or -P asks
+    if (opt_passthrough && 0 == cchl_info(fd) && (!page_empty(buf) || opt_first_page == 0))
+        start = 0;
+
+    if (opt_dual_slot)
+    {
+        if (0 != prepare_slot_image(fd, buf))
             return 1;
+        start = SLOT_B_START;
+        end = SLOT_B_START + SLOT_SIZE;
+    }
+
+    if (opt_first_page >= 0)
+    {
+        if (start < opt_first_page * 1024)
+            start = opt_first_page * 1024;
+        if (end > (opt_last_page + 1) * 1024)
+            end = (opt_last_page + 1) * 1024;
+    }
+
+    for (i=start;i<end;i+=1024)
+    {
+        bool all_empty = page_empty(buf + i);
+
+        if (!all_empty && opt_passthrough && (cchl_caps & CCHL_MULTI_PAGE))
+        {
+            // take as many following pages with data as the slave can hold
+            int count = 1;
+            while (count < CCHL_MAX_PAGES && i + count * 1024 < end && !page_empty(buf + i + count * 1024))
+                count++;
+
+            printf("Erasing, programming and verifying pages %d-%d\n", i/1024, i/1024 + count - 1);
+            if (0 != cchl_write_pages(fd, buf + i, i/1024, count))
+            {
+                fprintf(stderr, "cchl_write_pages failed\n");
+                return 1;
+            }
+            i += (count - 1) * 1024;
+        }
+        else if (!all_empty)
+        {
+            printf("Erasing, programming and verifying page %d\n", i/1024);
+            if (relay_batched)
+                rc = relay_write_page(fd, buf + i, i/1024);
+            else
+                rc = erase_program_verify_page(fd, buf + i, i/1024);
+            if (0 != rc)
+            {
+                fprintf(stderr, "erase_program_verify_page failed\n");
+                return 1;
+            }
         }
         else
         {
-            printf("Bootloader detected\n");
+            printf("Erasing page %d\n", i/1024);
+            if (0 != erase_page(fd, i/1024))
+            {
+                fprintf(stderr, "erase failed\n");
+                return 1;
+            }
         }
+    }
+    if (0 != send_jump(fd))
+    {
+        fprintf(stderr, "send jump failed\n");
+        return 1;
+    }
+
+    if (relay_batched)
+        printf("%lu radio retries\n", relay_retries);
+
+    if (gang_targets > 1)
+    {
+        for (i=0;i<gang_targets;i++)
+            printf("target %d: %s\n", i, (gang_failed & (1 << i)) ? "failed" : "ok");
+        if (gang_failed)
+            return 1;
+    }
+    // from the bootloader answering, for comparing builds of cchl and ccrl
+    gettimeofday(&now, NULL);
+    ms = (now.tv_sec - start_time.tv_sec) * 1000 + (now.tv_usec - start_time.tv_usec) / 1000;
+    printf("Programming complete in %ld.%03lds\n", ms / 1000, ms % 1000);
 
-        for (i=0x400;i<32*1024;i+=1024)
+    return 0;
+}
+
+// List the nodes which have dropped out, returns how many are left
+static int report_nodes(uint8_t ok, uint8_t was)
+{
+    int left = 0;
+    int i;
+
+    for (i=0;i<num_nodes;i++)
+    {
+        if ((was & (1 << i)) && !(ok & (1 << i)))
+            printf("node %02X dropped\n", relay_nodes[i]);
+        if (ok & (1 << i))
+            left++;
+    }
+    return left;
+}
+
+// Update every node given with -n through one relay, which broadcasts each
+// page and then fixes up the nodes which missed parts of it
+int flash_multicast(int fd, uint8_t *buf)
+{
+    uint8_t cmd[2 + MAX_RELAYS];
+    uint8_t joined;
+    uint8_t ok;
+    int start = 0x400;
+    int end = 32*1024;
+    int i;
+
+    if (opt_channel >= 0 && 0 != relay_select(fd, opt_channel, 0))
+    {
+        fprintf(stderr, "Failed to set up relay\n");
+        return 1;
+    }
+
+    cmd[0] = 'm';
+    cmd[1] = num_nodes;
+    for (i=0;i<num_nodes;i++)
+        cmd[2 + i] = relay_nodes[i];
+    if (serialWrite(fd, cmd, 2 + num_nodes) != 2 + num_nodes)
+        return 1;
+
+    if (0 != wait_for_bootloader(fd, opt_timeout))
+    {
+        fprintf(stderr, "No bootloader detected\n");
+        return 1;
+    }
+
+    cmd[0] = 'N';
+    if (serialWrite(fd, cmd, 1) != 1 || serialRead(fd, &joined, 1) != 1)
+    {
+        fprintf(stderr, "Relay does not support multicast\n");
+        return 1;
+    }
+    printf("%d of %d nodes joined\n", report_nodes(joined, 0xFF >> (8 - num_nodes)), num_nodes);
+
+    if (opt_first_page >= 0)
+    {
+        if (start < opt_first_page * 1024)
+            start = opt_first_page * 1024;
+        if (end > (opt_last_page + 1) * 1024)
+            end = (opt_last_page + 1) * 1024;
+    }
+
+    for (i=start;i<end && joined;i+=1024)
+    {
+        if (!page_empty(buf + i))
         {
-            bool all_empty = true;
-            for (j=i;j<i+1024;j++)
+            printf("Erasing, programming and verifying page %d\n", i/1024);
+            if (0 != relay_mcast_page(fd, buf + i, i/1024, &ok))
             {
-                if (buf[j] != 0xFF)
-                {
-                    all_empty = false;
-                    break;
-                }
+                fprintf(stderr, "relay_mcast_page failed\n");
+                return 1;
             }
-            if (!all_empty)
+            report_nodes(ok, joined);
+            joined = ok;
+        }
+        else
+        {
+            printf("Erasing page %d\n", i/1024);
+            if (0 != erase_page(fd, i/1024))
             {
-                printf("Erasing, programming and verifying page %d\n", i/1024);
-                if (0 != erase_program_verify_page(fd, buf + i, i/1024))
-                {
-                    fprintf(stderr, "erase_program_verify_page failed\n");
-                    return 1;
-                }
+                fprintf(stderr, "erase failed\n");
+                return 1;
             }
-            else
+        }
+    }
+    if (joined && 0 != send_jump(fd))
+    {
+        fprintf(stderr, "send jump failed\n");
+        return 1;
+    }
+
+    printf("%lu radio retries\n", relay_retries);
+    for (i=0;i<num_nodes;i++)
+        printf("node %02X: %s\n", relay_nodes[i], (joined & (1 << i)) ? "ok" : "failed");
+
+    return joined != (0xFF >> (8 - num_nodes));
+}
+
+#ifndef WIN32
+// Update one node per relay at the same time, each relay is driven by its
+// own process and moves its node to its own channel
+int flash_relays(uint8_t *buf)
+{
+    pid_t pids[MAX_RELAYS];
+    int status;
+    int failed = 0;
+    int fd;
+    int rc;
+    int i;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for (i=0;i<num_devices;i++)
+    {
+        if ((pids[i] = fork()) < 0)
+        {
+            fprintf(stderr, "fork failed\n");
+            failed = 1;
+            continue;
+        }
+        if (pids[i] == 0)
+        {
+            device_name = device_names[i];
+            opt_node = relay_nodes[i];
+            opt_channel = relay_channels[i];
+            if ((fd = serialOpen(device_name)) < 0)
             {
-                printf("Erasing page %d\n", i/1024);
-                if (0 != erase_page(fd, i/1024))
-                {
-                    fprintf(stderr, "erase failed\n");
-                    return 1;
-                }
+                fprintf(stderr, "Failed to open %s\n", device_name);
+                exit(1);
             }
+            rc = flash_device(fd, buf);
+            serialClose(fd);
+            exit(rc);
+        }
+    }
+
+    for (i=0;i<num_devices;i++)
+    {
+        if (pids[i] < 0)
+            continue;
+        waitpid(pids[i], &status, 0);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        {
+            printf("%s: node %02X updated on channel %d\n", device_names[i], relay_nodes[i], relay_channels[i]);
         }
-        if (0 != send_jump(fd))
+        else
         {
-            fprintf(stderr, "send jump failed\n");
+            printf("%s: node %02X failed\n", device_names[i], relay_nodes[i]);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    int fd;
+    int rc;
+    uint8_t *buf;
+
+    if (NULL == (buf=malloc(32*1024)))
+    {
+        fprintf(stderr, "out of ram\n");
+        return 1;
+    }   
+
+    if (0 != parse_options(argc, argv))
+    {
+        usage();
+        return 1;
+    }
+
+    if (opt_flash)
+    {
+        memset(buf, 0xFF, 32*1024);
+        if (0 != read_hexfile(buf, 32*1024, flash_filename))
+        {
+            fprintf(stderr, "Failed to read %s\n", flash_filename);
             return 1;
         }
+    }
+
+#ifndef WIN32
+    if (num_devices > 1)
+        return flash_relays(buf);
+#endif
 
-        printf("Programming complete\n");
+    if ((fd = serialOpen(device_name)) < 0)
+    {
+        fprintf(stderr, "Failed to open %s\n", device_name);
+        return 1;
+    }
+
+    if (opt_multicast)
+    {
+        rc = flash_multicast(fd, buf);
+        serialClose(fd);
+        return rc;
     }
 
+    if (opt_flash && 0 != flash_device(fd, buf))
+        return 1;
+
     if (opt_console)
     {
         atexit(do_exit);
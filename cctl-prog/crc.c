@@ -0,0 +1,26 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crc.h"
+
+// CRC16 as calculated by writing bytes to the CC1110's RNDH register,
+// polynomial X^16 + X^15 + X^2 + 1, MSB first. The bootloaders seed it
+// with 0xFFFF.
+uint16_t crc16(uint16_t crc, const uint8_t *buf, size_t len)
+{
+    int i;
+
+    while(len--)
+    {
+        crc ^= (uint16_t)(*buf++) << 8;
+        for (i=0;i<8;i++)
+        {
+            if (crc & 0x8000)
+                crc = (crc << 1) ^ 0x8005;
+            else
+                crc <<= 1;
+        }
+    }
+    return crc;
+}
+
@@ -0,0 +1,7 @@
+#ifndef CRC_H
+#define CRC_H 1
+
+uint16_t crc16(uint16_t crc, const uint8_t *buf, size_t len);
+
+#endif
+
@@ -0,0 +1,480 @@
+/*
+ * CCTL-RF link simulator
+ * Replays the cctl-rf radio protocol over a lossy link, so protocol
+ * changes can be compared without two boards on a bench.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "hex.h"
+#include "crc.h"
+
+#define FLASH_SIZE (32*1024)
+#define PAGE_SIZE 1024
+#define MAX_RETRIES 1000
+
+// Bytes sent around the payload: preamble, sync word (sent twice for
+// 30/32 sync), length and CRC, as configured in cctl-rf/start.asm
+#define PKT_OVERHEAD (4 + 4 + 1 + 2)
+
+// Flash timings from the CC1110 datasheet
+#define ERASE_TIME 0.020
+#define WRITE_TIME (512 * 20e-6)
+
+static struct option long_options[] =
+{
+    {"help",    no_argument, 0, 'h'},
+    {"flash",     required_argument, 0, 'f'},
+    {"loss",     required_argument, 0, 'l'},
+    {"crc",     required_argument, 0, 'c'},
+    {"rate",     required_argument, 0, 'r'},
+    {"turnaround",     required_argument, 0, 't'},
+    {"seed",     required_argument, 0, 's'},
+    {0, 0, 0, 0}
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "ChipCon Tiny Loader RF link simulator\n");
+    fprintf(stderr, "cctl-rf-sim -f file.hex [-l loss] [-c crc] [-r kbaud] [-t ms]\n");
+    fprintf(stderr, "  --help           -h          This help\n");
+    fprintf(stderr, "  --flash=file.hex -f file.hex Image to send\n");
+    fprintf(stderr, "  --loss=p         -l p        Probability a packet is lost (0.0)\n");
+    fprintf(stderr, "  --crc=p          -c p        Probability a packet fails its CRC (0.0)\n");
+    fprintf(stderr, "  --rate=n         -r n        Data rate in kbaud (250)\n");
+    fprintf(stderr, "  --turnaround=n   -t n        Node delay before each reply in ms (20.2)\n");
+    fprintf(stderr, "  --seed=n         -s n        Random seed (1)\n");
+}
+
+static char *flash_filename = NULL;
+static double opt_loss = 0.0;
+static double opt_crc = 0.0;
+static double opt_rate = 250.0;
+// Timer3 in tx_pkt(): 256 counts of 26MHz / 32 (TICKSPD) / 64 (DIV)
+static double opt_turnaround = 20.2;
+static unsigned int opt_seed = 1;
+
+// Protocol variant under test
+struct strategy
+{
+    const char *name;
+    bool burst;         // 0x06/0x07 instead of acked 0x04
+    uint8_t seglen;     // 64, or up to 240 with LARGE_SEGMENTS
+    bool crc_verify;    // 0x08 instead of reading back with 0x03
+};
+
+// Model of a node running cctl-rf with every option enabled
+struct node
+{
+    uint8_t flash[FLASH_SIZE];
+    uint8_t rambuf[PAGE_SIZE];
+    uint8_t seglen;
+    uint16_t seg_map;
+    double last_rx;
+};
+
+struct sim
+{
+    struct node node;
+    const struct strategy *st;
+    double time;
+    int packets;
+    int lost;
+    int bad_crc;
+    int retries;
+    bool reset;
+};
+
+static double airtime(int len)
+{
+    return (PKT_OVERHEAD + len) * 8 / (opt_rate * 1000);
+}
+
+// Whether a packet makes it across, packets with a bad CRC are dropped
+// by the receiver just like lost ones (LQI & 0x80 clear)
+static bool deliver(struct sim *sim)
+{
+    double r = (double)rand() / RAND_MAX;
+
+    if (r < opt_loss)
+    {
+        sim->lost++;
+        return false;
+    }
+    if (r < opt_loss + opt_crc)
+    {
+        sim->bad_crc++;
+        return false;
+    }
+    return true;
+}
+
+// The upgrade loop from cctl-rf/main.c. Returns the reply length, or 0
+// for commands which are not acked, and adds the node's busy time.
+static int node_rx(struct sim *sim, uint8_t *buf)
+{
+    struct node *node = &sim->node;
+    uint16_t i;
+    int n;
+
+    if (sim->time - node->last_rx > 1.0)
+        sim->reset = true;  // watchdog
+    node->last_rx = sim->time;
+
+    buf[1] = 0xFD;
+    switch(buf[2])
+    {
+        case 1:
+            memset(node->flash + buf[3] * PAGE_SIZE, 0xFF, PAGE_SIZE);
+            sim->time += ERASE_TIME;
+            return 4;
+        case 2:
+            for (i=0;i<PAGE_SIZE;i++)
+                node->flash[buf[3] * PAGE_SIZE + i] &= node->rambuf[i];
+            node->seg_map = 0;
+            sim->time += WRITE_TIME;
+            return 4;
+        case 3:
+            i = buf[3] * PAGE_SIZE + buf[4] * node->seglen;
+            for (n=0;n<node->seglen && i + n < FLASH_SIZE;n++)
+                buf[5 + n] = node->flash[i + n];
+            return 4 + node->seglen;
+        case 4:
+        case 6:
+            i = buf[4] * node->seglen;
+            for (n=0;n<node->seglen && i < PAGE_SIZE;n++)
+                node->rambuf[i++] = buf[5 + n];
+            node->seg_map |= 1 << buf[4];
+            return buf[2] == 6 ? 0 : 4;
+        case 7:
+            buf[3] = node->seg_map & 0xFF;
+            buf[4] = node->seg_map >> 8;
+            return 4;
+        case 8:
+            i = crc16(0xFFFF, node->flash + buf[3] * PAGE_SIZE, buf[4] * PAGE_SIZE);
+            buf[4] = i & 0xFF;
+            buf[5] = i >> 8;
+            return 5;
+    }
+    return 4;
+}
+
+// Send a packet without waiting for anything back
+static void send(struct sim *sim, uint8_t *buf)
+{
+    sim->packets++;
+    sim->time += airtime(buf[0]);
+    if (deliver(sim))
+        node_rx(sim, buf);
+}
+
+// Send a command and wait for its reply, retrying on timeout
+static int transact(struct sim *sim, const uint8_t *cmd, uint8_t *rsp)
+{
+    // long enough for the node's turnaround and a full reply
+    double timeout = opt_turnaround / 1000 + ERASE_TIME + airtime(255);
+    int attempts = 0;
+    int len;
+
+    do
+    {
+        if (attempts++ > 0)
+            sim->retries++;
+
+        sim->packets++;
+        sim->time += airtime(cmd[0]);
+        if (!deliver(sim))
+        {
+            sim->time += timeout;
+            continue;
+        }
+
+        memcpy(rsp, cmd, 256);
+        len = node_rx(sim, rsp);
+
+        sim->time += opt_turnaround / 1000 + airtime(len);
+        sim->packets++;
+        if (!deliver(sim))
+        {
+            sim->time += timeout;
+            continue;
+        }
+
+        rsp[0] = len;
+        return 0;
+    }
+    while(attempts < MAX_RETRIES && !sim->reset);
+
+    return 1;
+}
+
+static int load_page(struct sim *sim, const uint8_t *data)
+{
+    const struct strategy *st = sim->st;
+    int segs = (PAGE_SIZE + st->seglen - 1) / st->seglen;
+    uint16_t want = (1 << segs) - 1;
+    uint16_t have = 0;
+    uint8_t cmd[256], rsp[256];
+    int s, n;
+
+    while(have != want)
+    {
+        for (s=0;s<segs;s++)
+        {
+            if (have & (1 << s))
+                continue;
+
+            n = PAGE_SIZE - s * st->seglen;
+            if (n > st->seglen)
+                n = st->seglen;
+
+            cmd[0] = 4 + n;
+            cmd[1] = 0xFE;
+            cmd[2] = st->burst ? 6 : 4;
+            cmd[3] = 0;
+            cmd[4] = s;
+            memcpy(cmd + 5, data + s * st->seglen, n);
+
+            if (st->burst)
+            {
+                send(sim, cmd);
+                sim->time += 0.001;     // let the node return to RX
+            }
+            else
+            {
+                if (0 != transact(sim, cmd, rsp))
+                    return 1;
+                have |= 1 << s;
+            }
+        }
+
+        if (st->burst)
+        {
+            cmd[0] = 2;
+            cmd[1] = 0xFE;
+            cmd[2] = 7;
+            if (0 != transact(sim, cmd, rsp))
+                return 1;
+            have = (rsp[3] | (rsp[4] << 8)) & want;
+        }
+    }
+
+    return 0;
+}
+
+static int verify_page(struct sim *sim, const uint8_t *data, uint8_t page, bool *ok)
+{
+    const struct strategy *st = sim->st;
+    int segs = (PAGE_SIZE + st->seglen - 1) / st->seglen;
+    uint8_t cmd[256], rsp[256];
+    int s, n;
+
+    *ok = true;
+
+    if (st->crc_verify)
+    {
+        cmd[0] = 4;
+        cmd[1] = 0xFE;
+        cmd[2] = 8;
+        cmd[3] = page;
+        cmd[4] = 1;
+        if (0 != transact(sim, cmd, rsp))
+            return 1;
+        *ok = (rsp[4] | (rsp[5] << 8)) == crc16(0xFFFF, data, PAGE_SIZE);
+        return 0;
+    }
+
+    for (s=0;s<segs;s++)
+    {
+        n = PAGE_SIZE - s * st->seglen;
+        if (n > st->seglen)
+            n = st->seglen;
+
+        cmd[0] = 4;
+        cmd[1] = 0xFE;
+        cmd[2] = 3;
+        cmd[3] = page;
+        cmd[4] = s;
+        if (0 != transact(sim, cmd, rsp))
+            return 1;
+        if (0 != memcmp(rsp + 5, data + s * st->seglen, n))
+            *ok = false;
+    }
+    return 0;
+}
+
+static int command(struct sim *sim, uint8_t cmd_id, uint8_t page)
+{
+    uint8_t cmd[256], rsp[256];
+
+    cmd[0] = 4;
+    cmd[1] = 0xFE;
+    cmd[2] = cmd_id;
+    cmd[3] = page;
+    cmd[4] = 0;
+    return transact(sim, cmd, rsp);
+}
+
+// Update every page from 0x400 up, in the same way as cctl-prog
+static int run(struct sim *sim, const struct strategy *st, const uint8_t *image)
+{
+    int page, i;
+    bool ok;
+
+    memset(sim, 0, sizeof(*sim));
+    memset(sim->node.flash, 0xFF, FLASH_SIZE);
+    sim->node.seglen = st->seglen;
+    sim->st = st;
+
+    for (page=1;page<FLASH_SIZE/PAGE_SIZE;page++)
+    {
+        const uint8_t *data = image + page * PAGE_SIZE;
+        bool all_empty = true;
+
+        for (i=0;i<PAGE_SIZE;i++)
+        {
+            if (data[i] != 0xFF)
+            {
+                all_empty = false;
+                break;
+            }
+        }
+
+        if (all_empty)
+        {
+            if (0 != command(sim, 1, page))
+                return 1;
+            continue;
+        }
+
+        do
+        {
+            if (0 != load_page(sim, data) ||
+                0 != command(sim, 1, page) ||
+                0 != command(sim, 2, page) ||
+                0 != verify_page(sim, data, page, &ok))
+                return 1;
+        }
+        while(!ok);
+    }
+
+    if (sim->reset)
+        return 1;
+
+    return memcmp(sim->node.flash + PAGE_SIZE, image + PAGE_SIZE, FLASH_SIZE - PAGE_SIZE) != 0;
+}
+
+static int parse_options(int argc, char **argv)
+{
+    int c;
+    int option_index;
+
+    while(1)
+    {
+        c = getopt_long (argc, argv, "hf:l:c:r:t:s:", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch(c)
+        {
+            case 'h':
+                return 1;
+            break;
+            case 'f':
+                flash_filename = strdup(optarg);
+            break;
+            case 'l':
+                opt_loss = atof(optarg);
+            break;
+            case 'c':
+                opt_crc = atof(optarg);
+            break;
+            case 'r':
+                opt_rate = atof(optarg);
+            break;
+            case 't':
+                opt_turnaround = atof(optarg);
+            break;
+            case 's':
+                opt_seed = atoi(optarg);
+            break;
+            default:
+                return 1;
+            break;
+        }
+    }
+
+    if (NULL == flash_filename)
+        return 1;
+
+    return 0;
+}
+
+static const struct strategy strategies[] =
+{
+    { "64B acked segments, readback",   false,  64, false },
+    { "64B burst, readback",            true,   64, false },
+    { "64B burst, page CRC",            true,   64, true  },
+    { "240B burst, page CRC",           true,  240, true  },
+};
+
+int main(int argc, char *argv[])
+{
+    static struct sim sim;
+    uint8_t *buf;
+    size_t i;
+
+    if (0 != parse_options(argc, argv))
+    {
+        usage();
+        return 1;
+    }
+
+    if (NULL == (buf=malloc(FLASH_SIZE)))
+    {
+        fprintf(stderr, "out of ram\n");
+        return 1;
+    }
+
+    memset(buf, 0xFF, FLASH_SIZE);
+    if (0 != read_hexfile(buf, FLASH_SIZE, flash_filename))
+    {
+        fprintf(stderr, "Failed to read %s\n", flash_filename);
+        return 1;
+    }
+
+    printf("%.0f kbaud, %.1f%% lost, %.1f%% bad CRC, %.1f ms turnaround\n\n",
+        opt_rate, opt_loss * 100, opt_crc * 100, opt_turnaround);
+    printf("%-32s %9s %8s %8s\n", "Protocol", "Time (s)", "Packets", "Retries");
+
+    for (i=0;i<sizeof(strategies)/sizeof(strategies[0]);i++)
+    {
+        srand(opt_seed);
+        if (0 != run(&sim, &strategies[i], buf))
+        {
+            printf("%-32s %9s\n", strategies[i].name, sim.reset ? "watchdog" : "failed");
+            continue;
+        }
+        printf("%-32s %9.2f %8d %8d\n", strategies[i].name, sim.time, sim.packets, sim.retries);
+    }
+
+    return 0;
+}
+
@@ -31,12 +31,78 @@
 
 //#define CONSOLE_DEBUG 
 
+// Optional protocol extensions, advertised in the boot beacon. Not all of
+// them fit in the 1KB page at once, check the binary size when enabling.
+
+// Load segments back to back, acked once per page with a bitmap
+//#define BURST_LOAD
+
+// Segments of up to SEGLEN_MAX bytes, size picked in the handshake
+//#define LARGE_SEGMENTS
+
+// CRC16 of a range of flash pages in one packet
+//#define PAGE_CRC
+
+// Alternative data rates the programmer can switch to after the handshake
+//#define RATE_PROFILES
+
+// Move to the channel given in the programmer's reply to the boot packets,
+// so several relays can update nodes at once. Boot packets stay on CHANNR
+// from start.asm.
+//#define CHANNEL_SELECT
+
+// Accept segments, erase and program broadcast to address 0x00 by the
+// relay, without acking them. Needs BURST_LOAD and PAGE_CRC, and each
+// node must have its own ADDR. Remember to change in start.asm also.
+//#define MULTICAST
+
 #include <stdint.h>
 #include <cc1110.h>
 #include "cc1110-ext.h"
 
 #define RADIOBUF_MAX 256
 
+#ifdef BURST_LOAD
+#define CAP_BURST_LOAD 0x01
+#else
+#define CAP_BURST_LOAD 0
+#endif
+#ifdef LARGE_SEGMENTS
+#define CAP_LARGE_SEGMENTS 0x02
+#define SEGLEN_MAX 240
+#define SEGLEN seglen
+#define SEG_OFFSET(s) ((uint16_t)(s) * seglen)
+#else
+#define CAP_LARGE_SEGMENTS 0
+#define SEGLEN_MAX 64
+#define SEGLEN 64
+#define SEG_OFFSET(s) ((s) << 6)
+#endif
+#ifdef PAGE_CRC
+#define CAP_PAGE_CRC 0x04
+#else
+#define CAP_PAGE_CRC 0
+#endif
+#ifdef MULTICAST
+#if !defined(BURST_LOAD) || !defined(PAGE_CRC)
+#error MULTICAST needs BURST_LOAD and PAGE_CRC
+#endif
+#define CAP_MULTICAST 0x08
+#else
+#define CAP_MULTICAST 0
+#endif
+#ifdef RATE_PROFILES
+#define CAP_RATE_PROFILES 0x10
+#else
+#define CAP_RATE_PROFILES 0
+#endif
+#ifdef CHANNEL_SELECT
+#define CAP_CHANNEL_SELECT 0x20
+#else
+#define CAP_CHANNEL_SELECT 0
+#endif
+#define CAPS (CAP_BURST_LOAD | CAP_LARGE_SEGMENTS | CAP_PAGE_CRC | CAP_MULTICAST | CAP_RATE_PROFILES | CAP_CHANNEL_SELECT)
+
 // Flash write timer value:
 // FWT = 21000 * FCLK / (16 * 10^9)
 // For FCLK = 24MHz, FWT = 0x1F
@@ -49,13 +115,39 @@
 #endif
 // Address of flash controller data register
 #define FLASH_FWDATA_ADDR 0xDFAF
+// Address of radio data register
+#define RFD_ADDR 0xDFD9
 
 
 
 static __xdata struct cc_dma_channel dma0_config;
+static __xdata struct cc_dma_channel dma1_config;  // radio
 
 static __xdata uint8_t radiobuf[RADIOBUF_MAX];
-static uint8_t radiobuf_index;
+#ifdef BURST_LOAD
+static uint16_t seg_map;    // segments loaded since the last program
+#endif
+#ifdef LARGE_SEGMENTS
+static uint8_t seglen;      // bytes per segment, picked by the programmer
+#endif
+#ifdef RATE_PROFILES
+static uint8_t profile;
+// MDMCFG4, MDMCFG3, MDMCFG2, DEVIATN. Profile 0 matches start.asm.
+static const __code uint8_t profiles[4][4] = {
+#ifdef CRYSTAL_26_MHZ
+	{ 0x2D, 0x3B, 0x13, 0x62 },	// 250 kbaud GFSK
+	{ 0x0E, 0x3B, 0x73, 0x00 },	// 500 kbaud MSK
+	{ 0x5B, 0xF8, 0x13, 0x47 },	// 100 kbaud GFSK
+	{ 0xCA, 0x83, 0x13, 0x35 },	// 38.4 kbaud GFSK
+#endif
+#ifdef CRYSTAL_24_MHZ
+	{ 0x1D, 0x55, 0x13, 0x62 },	// 250 kbaud GFSK
+	{ 0x0E, 0x55, 0x73, 0x00 },	// 500 kbaud MSK
+	{ 0x5C, 0x11, 0x13, 0x47 },	// 100 kbaud GFSK
+	{ 0xCA, 0xA3, 0x13, 0x35 },	// 38.4 kbaud GFSK
+#endif
+};
+#endif
 #ifdef CONSOLE_DEBUG
 static __xdata uint8_t * __at (0x0000) flashp;
 #endif
@@ -75,10 +167,15 @@ struct cc_dma_channel
 };
 
 #define DMA_CFG0_TRIGGER_FLASH     18
+#define DMA_CFG0_TRIGGER_RADIO     19
+#define DMA_CFG1_SRCINC_0      (0 << 6)
 #define DMA_CFG1_SRCINC_1      (1 << 6)
 #define DMA_CFG1_DESTINC_0     (0 << 4)
+#define DMA_CFG1_DESTINC_1     (1 << 4)
 #define DMA_CFG1_PRIORITY_HIGH     (2 << 0)
 #define DMAARM_DMAARM0         (1 << 0)
+#define DMAARM_DMAARM1         (1 << 1)
+#define DMAARM_ABORT           (1 << 7)
 
 #define DMA_LEN_HIGH_VLEN_MASK     (7 << 5)
 #define DMA_LEN_HIGH_VLEN_LEN      (0 << 5)
@@ -246,18 +343,27 @@ void cons_puts(const char *s)
 }
 #endif
 
-void rftxrx_isr(void) __interrupt RFTXRX_VECTOR {
-	switch (MARCSTATE) {
-		case MARC_STATE_RX:
-			radiobuf[radiobuf_index] = RFD;
-			goto inc;  // stupid way but saves space.
-			break;
-		case MARC_STATE_TX:
-			RFD = radiobuf[radiobuf_index];
-inc:
-			radiobuf_index++;
-			break;
+// Radio bytes are moved between RFD and radiobuf by DMA channel 1.
+// The length byte sets the transfer size, received packets also carry
+// the two appended status bytes.
+void radio_dma(uint8_t tx) {
+	DMAARM = DMAARM_ABORT | DMAARM_DMAARM1;
+	if (tx) {
+		dma1_config.src_high = (uint16_t)radiobuf >> 8;
+		dma1_config.src_low  = (uint16_t)radiobuf & 0x00FF;
+		dma1_config.dst_high = RFD_ADDR >> 8;
+		dma1_config.dst_low  = RFD_ADDR & 0x00FF;
+		dma1_config.len_high = DMA_LEN_HIGH_VLEN_PLUS_1 | (RADIOBUF_MAX >> 8);
+		dma1_config.cfg1 = DMA_CFG1_SRCINC_1 | DMA_CFG1_DESTINC_0 | DMA_CFG1_PRIORITY_HIGH;
+	} else {
+		dma1_config.src_high = RFD_ADDR >> 8;
+		dma1_config.src_low  = RFD_ADDR & 0x00FF;
+		dma1_config.dst_high = (uint16_t)radiobuf >> 8;
+		dma1_config.dst_low  = (uint16_t)radiobuf & 0x00FF;
+		dma1_config.len_high = DMA_LEN_HIGH_VLEN_PLUS_3 | (RADIOBUF_MAX >> 8);
+		dma1_config.cfg1 = DMA_CFG1_SRCINC_0 | DMA_CFG1_DESTINC_1 | DMA_CFG1_PRIORITY_HIGH;
 	}
+	DMAARM |= DMAARM_DMAARM1;
 }
 void tx_pkt(void) {
 #ifdef CONSOLE_DEBUG
@@ -269,7 +375,7 @@ void tx_pkt(void) {
 	while (!T3OVFIF);
 	T3CTL=0;
 	radiobuf[1]=0xFD; // Set dev once to save space
-	radiobuf_index=0;
+	radio_dma(1);
         RFST = RFST_STX;      /* enter TX */
 	while(MARCSTATE != MARC_STATE_TX);
         //while (!(RFIF & RFIF_IRQ_DONE));
@@ -302,12 +408,10 @@ uint8_t rx_pkt(void) {
 #endif
 			while(MARCSTATE != MARC_STATE_IDLE);
 			return 1;
-		} else {
-			radiobuf_index=0;
 		}
 	}
 	if (MARCSTATE != MARC_STATE_RX) {
-		radiobuf_index=0;
+		radio_dma(0);
 		RFST = RFST_SRX; // Set RX mode
 		while (MARCSTATE != MARC_STATE_RX);
 #ifdef CONSOLE_DEBUG
@@ -317,6 +421,18 @@ uint8_t rx_pkt(void) {
 	return 0;
 }
 
+#ifdef RATE_PROFILES
+void radio_profile(uint8_t p) {
+	profile = p & 3;
+	RFST = RFST_SIDLE;
+	while(MARCSTATE != MARC_STATE_IDLE);
+	MDMCFG4 = profiles[profile][0];
+	MDMCFG3 = profiles[profile][1];
+	MDMCFG2 = profiles[profile][2];
+	DEVIATN = profiles[profile][3];
+}
+#endif
+
 void radio_init(void) {
 	uint8_t a,b;
 	uint16_t p;
@@ -430,9 +546,11 @@ void radio_init(void) {
         IEN2 |= IEN2_RFIE;
         RFIM |= RFIF_IRQ_DONE   | RFIF_IRQ_TXUNF  | RFIF_IRQ_RXOVF  | RFIF_IRQ_SFD    | RFIF_IRQ_TIMEOUT;
 #endif
-        radiobuf_index = RFIF = 0;
-	RFTXRXIF = 0;       /* enable interrupts */
-        RFTXRXIE = 1;
+	dma1_config.len_low = RADIOBUF_MAX & 0x00FF;
+	dma1_config.cfg0 = DMA_CFG0_WORDSIZE_8 | DMA_CFG0_TMODE_SINGLE | DMA_CFG0_TRIGGER_RADIO;
+	DMA1CFGH = ((uint16_t)&dma1_config >> 8) & 0x00FF;
+	DMA1CFGL = (uint16_t)&dma1_config & 0x00FF;
+        RFIF = 0;
         RFST = RFST_SIDLE;      /* enter idle */
 	while(MARCSTATE != MARC_STATE_IDLE);
 }
@@ -442,6 +560,12 @@ void radio_init(void) {
 void bootloader_main(void) {
 	uint8_t n;
 	uint16_t i;
+#ifdef RATE_PROFILES
+	uint16_t idle = 0;
+#endif
+#ifdef PAGE_CRC
+	uint16_t end;
+#endif
 
 	// Initialise clocks
 	SLEEP &= ~SLEEP_OSC_PD;	// enable RC oscillator
@@ -465,9 +589,6 @@ void bootloader_main(void) {
 
 	radio_init();
 
-	F1 = 1;
-	EA = 1;
-
 	
 #ifdef CONSOLE_DEBUG
 	cons_puts("\r\nBOOT\r\n");
@@ -477,7 +598,14 @@ void bootloader_main(void) {
 	while(n > 2) {
 		if (rx_pkt()) n=0;
 		if (i-- == 0) {
+#if CAPS
+			radiobuf[0] = 5;
+			radiobuf[3] = CAPS;
+			radiobuf[4] = SEGLEN_MAX;
+			radiobuf[5] = ADDR;
+#else
 			radiobuf[0] = 2;
+#endif
 			radiobuf[2] = 0x10;
 			tx_pkt();
 #ifdef CONSOLE_DEBUG
@@ -486,8 +614,21 @@ void bootloader_main(void) {
 			n--;
 		}
 	}
-	if (n == 0)
+	if (n == 0) {
+#ifdef LARGE_SEGMENTS
+		// A reply without a segment size is from an older programmer
+		seglen = 64;
+		if (radiobuf[0] > 2 && (uint8_t)(radiobuf[3] - 64) <= SEGLEN_MAX - 64)
+			seglen = radiobuf[3];
+#endif
+#ifdef CHANNEL_SELECT
+		// radio is idle after rx_pkt(), the watchdog resets us back to
+		// the boot channel if the programmer is lost
+		if (radiobuf[0] > 3)
+			CHANNR = radiobuf[4];
+#endif
 		goto upgrade_loop;
+	}
 
 	jump_to_user();
 
@@ -501,8 +642,16 @@ upgrade_loop:
 	while(1) {
 		if (rx_pkt()) {
 			WDCTL = 0xA8; WDCTL = 0x58;
+#ifdef RATE_PROFILES
+			idle = 0;
+#endif
 			switch (radiobuf[2]) {
 				case 0:
+#ifdef RATE_PROFILES
+					// report how well the programmer is heard
+					radiobuf[3] = RSSI;
+					radiobuf[4] = LQI & 0x7F;
+#endif
 					goto ack;
 				case 1: //erase page
 					flash_erase_page();
@@ -510,15 +659,18 @@ upgrade_loop:
 					break;
 				case 2: //program page from rambuffer
 					flash_write();
+#ifdef BURST_LOAD
+					seg_map = 0;
+#endif
 					goto ack;
 					break;
 				case 3: //read page segment from flash
-					radiobuf[0]=68;
+					radiobuf[0]=4+SEGLEN;
 #ifdef CONSOLE_DEBUG
 					cons_puts("Read\r\n");
 #endif
-					i=(radiobuf[3]<<10)+(radiobuf[4]<<6);
-		   			for (n=5;n<69;n++) {
+					i=(radiobuf[3]<<10)+SEG_OFFSET(radiobuf[4]);
+		   			for (n=5;n<5+SEGLEN;n++) {
 #ifdef CONSOLE_DEBUG
 						cons_puthex8(flashp[i]);
 #endif
@@ -531,23 +683,81 @@ upgrade_loop:
 					tx_pkt();
 					break;
 				case 4:
+#ifdef BURST_LOAD
+				case 6: // load segment, no ack
+#endif
 #ifdef CONSOLE_DEBUG
 					cons_puts("Load Segment to ram\r\n");
 #endif
-					i=radiobuf[4]<<6;
-		   			for (n=5;n<69;n++) {
+					i=SEG_OFFSET(radiobuf[4]);
+		   			for (n=5;n<5+SEGLEN;n++) {
+#ifdef LARGE_SEGMENTS
+						if (i >= 1024)
+							break;  // last segment of the page is short
+#endif
 						rambuf[i]=radiobuf[n];
 						i++;
 					}
+#ifdef BURST_LOAD
+					seg_map |= 1 << radiobuf[4];
+					if (radiobuf[2] == 6)
+						break;
+#endif
 					goto ack;
 					break;
+#ifdef BURST_LOAD
+				case 7: // report loaded segments
+					radiobuf[3] = seg_map & 0xFF;
+					radiobuf[4] = seg_map >> 8;
+					goto ack;
+#endif
+#ifdef PAGE_CRC
+				case 8: // CRC16 of a range of pages, seeded with 0xFFFF
+					if (radiobuf[4] == 0 || (uint16_t)radiobuf[3] + radiobuf[4] > 32)
+						goto ack;	// NAK, no CRC in the reply
+					RNDL = 0xFF;
+					RNDL = 0xFF;
+					i = radiobuf[3] << 10;
+					end = (radiobuf[3] + radiobuf[4]) << 10;
+					do {
+						RNDH = *(__xdata uint8_t*)i;
+						i++;
+					} while (i != end);
+					radiobuf[0] = 5;
+					radiobuf[4] = RNDL;
+					radiobuf[5] = RNDH;
+					tx_pkt();
+					break;
+#endif
+#ifdef RATE_PROFILES
+				case 9: // change data rate, after the ack
+#ifdef MULTICAST
+					if (radiobuf[1] != 0x00)
+#endif
+					{
+						radiobuf[0] = 4;
+						tx_pkt();
+					}
+					radio_profile(radiobuf[3]);
+					break;
+#endif
 				case 5:
 					jump_to_user();
 				ack:
+#ifdef MULTICAST
+					if (radiobuf[1] == 0x00)
+						break;  // every node would answer a broadcast
+#endif
 					radiobuf[0] = 4;
 					tx_pkt();
 			}
 		}
+#ifdef RATE_PROFILES
+		else if (++idle == 0 && profile != 0) {
+			// lost the programmer, wait for it at the default rate
+			radio_profile(0);
+		}
+#endif
 	}
 }
 
@@ -2,6 +2,9 @@
 ; To select crystal frequency set 1 or 0
 CRYSTAL_26_MHZ=1
 ; Remember to change in main.c also.
+; Set to 1 to accept packets broadcast to address 0x00 (MULTICAST)
+MULTICAST=0
+; Remember to change in main.c also.
 ;
 	.globl __start__stack
 ;--------------------------------------------------------
@@ -19,18 +22,19 @@ __start__stack:
 __interrupt_vect:
         ljmp    __sdcc_gsinit_startup
 	
-    	jnb psw.1, 00001$  ; RFTXRX if F1=1 call bootload isr
-	ljmp _rftxrx_isr ; 
-	.ds	2
+	ljmp #(0x400+0x03) ; RFTXRX, the bootloader uses DMA
+	.ds	5
 	ljmp #(0x400+0x0B) ; ADC
-00001$:
-	ljmp #(0x400+0x03) ; User code RFTXRX usr
-	.ds	2
+	.ds	5
 	ljmp #(0x400+0x13) ; URX0
 					.db	0xD3 ; SYNC1
 					.db	0x91 ; SYNC0
 					.db	0xFF ; PKTLEN
+				.if MULTICAST
+					.db	0x06 ; PKTCTRL1
+				.else
 					.db	0x05 ; PKTCTRL1
+				.endif
 					.db	0x45 ; PKTCTRL0
 	ljmp #(0x400+0x1B) ; URX1
 					.db	0xFE ; ADDR
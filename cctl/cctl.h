@@ -0,0 +1,46 @@
+/*
+ * CCTL - ChipCon Tiny Loader
+ * Services exported by the bootloader to application code
+ * Joby Taffey (c) 2012 <jrt-cctl@hodgepig.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+#ifndef CCTL_H
+#define CCTL_H 1
+
+#include <stdint.h>
+
+// Applications using these must not place data in 0xF000-0xF409,
+// eg. link with --xram-loc 0xf40a
+
+// Page buffer written by cctl_flash_write()
+#define CCTL_RAMBUF ((__xdata uint8_t *)0xF000)
+
+// Entry points are LJMPs in start.asm at fixed addresses
+
+// Erase a 1KB page (0-31)
+#define cctl_flash_erase_page ((void (*)(uint8_t))0x008E)
+
+// Program a 1KB page (0-31) from CCTL_RAMBUF. Uses DMA channel 0, so
+// DMA0CFG must be restored afterwards if the application uses it, and
+// the DMA interrupt must not clear DMAIF0 while this runs.
+#define cctl_flash_write ((void (*)(uint8_t))0x0091)
+
+// Write CCTL_BOOT_REQUEST_MAGIC here and let the watchdog reset the chip
+// to go straight to upgrade mode, see cctl-app
+#define CCTL_BOOT_REQUEST (*(__xdata uint16_t *)0xF408)
+#define CCTL_BOOT_REQUEST_MAGIC 0xB007
+
+#endif
@@ -20,6 +20,9 @@
  * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
  */
 
+// APP_URX0 is defined by make APP_URX0=1 if the application owns the URX0
+// vector, the bootloader then polls the UART instead.
+
 #include <stdint.h>
 #include <cc1110.h>
 #include "cc1110-ext.h"
@@ -33,14 +36,22 @@
 #define FLASH_FWDATA_ADDR 0xDFAF
 
 
+#ifndef APP_URX0
 #define RXFIFO_ELEMENTS 2048
 #define RXFIFO_SIZE (RXFIFO_ELEMENTS - 1)
 static __xdata uint8_t rxfifo[RXFIFO_SIZE];
 static uint8_t rxfifo_in;
 static uint8_t rxfifo_out;
-static __xdata struct cc_dma_channel dma0_config;
+#endif
 static const __code uint8_t * __at (0x0000) flashp;
-__xdata uint8_t rambuf[1024];
+// Page buffer, fixed so it can also hold a stage-1 loader (see 'x')
+#define RAMBUF_ADDR 0xF000
+__xdata __at (RAMBUF_ADDR) uint8_t rambuf[1024];
+// Fixed too, applications calling the flash services must leave it alone
+static __xdata __at (RAMBUF_ADDR + 1024) struct cc_dma_channel dma0_config;
+// Set by an application before a watchdog reset to skip the boot window
+#define BOOT_REQUEST_MAGIC 0xB007
+static __xdata __at (RAMBUF_ADDR + 1024 + 8) uint16_t boot_request;
 uint8_t page;
 
 static const char banner[] = {'\r', '\n', 'C', 'C', 'T', 'L', '\r', '\n'};
@@ -80,12 +91,13 @@ struct cc_dma_channel
 #define DMA_CFG0_TMODE_REPEATED_BLOCK  (3 << 5)
 
 
-void flash_erase_page(void)
+// Also exported to applications through the table in start.asm
+void flash_erase_page(uint8_t pg)
 {
   while (FCTL & FCTL_BUSY);
   
   FWT = FLASH_FWT;
-  FADDRH = page << 1;
+  FADDRH = pg << 1;
   FADDRL = 0x00;
 
   // Erase the page that will be written to
@@ -126,7 +138,8 @@ void flash_write_trigger(void)
   __endasm;
 }
 
-void flash_write(void)
+// Also exported to applications through the table in start.asm
+void flash_write(uint8_t pg)
 {
   // Setup DMA descriptor
   dma0_config.src_high  = (((uint16_t)(__xdata uint16_t *)rambuf) >> 8) & 0x00FF;
@@ -156,8 +169,8 @@ void flash_write(void)
 
   // Configure the flash controller
   FWT = FLASH_FWT;
-  FADDRH = (page << 1) & 0x3F;
-  //FADDRL = 0;//(page << 9) & 0xFF;    // reset value is 0x00
+  FADDRH = (pg << 1) & 0x3F;
+  //FADDRL = 0;//(pg << 9) & 0xFF;    // reset value is 0x00
 
   // Arm the DMA channel, so that a DMA trigger will initiate DMA writing
   DMAARM |= DMAARM_DMAARM0;
@@ -179,6 +192,13 @@ void flash_write(void)
 
 uint8_t cons_getch(void)
 {
+#ifdef APP_URX0
+    if (!URX0IF)
+        return 0;
+    URX0IF = 0;
+    page = U0DBUF;
+    return 1;
+#else
     if (rxfifo_in == rxfifo_out)
         return 0;
     page = rxfifo[rxfifo_out];
@@ -187,6 +207,7 @@ uint8_t cons_getch(void)
     else
         rxfifo_out++;
     return 1;
+#endif
 }
 
 
@@ -197,6 +218,7 @@ void cons_putc(uint8_t ch)
     U0CSR &= ~U0CSR_TX_BYTE;         // Clear transmit byte status
 }
 
+#ifndef APP_URX0
 void uart0_isr(void) __interrupt URX0_VECTOR
 {
     URX0IF = 0;
@@ -211,9 +233,73 @@ void uart0_isr(void) __interrupt URX0_VECTOR
             rxfifo_in++;
     }
 }
+#endif
+
+#ifdef DUAL_SLOT
+// Slot A (pages 1-15) is where the application runs, slot B (pages 16-30)
+// is where updates are staged. Each slot ends with a header, an image in
+// slot B which is valid and newer than slot A is copied over on boot.
+#define SLOT_SIZE 0x3C00
+#define SLOT_MAGIC 0x4C54
+struct slot_header
+{
+    uint16_t magic;
+    uint16_t version;
+    uint16_t length;
+    uint16_t crc;       // CRC16 of length bytes from the start of the slot
+};
+#define SLOT_A ((__xdata struct slot_header *)(0x0400 + SLOT_SIZE - 8))
+#define SLOT_B ((__xdata struct slot_header *)(0x4000 + SLOT_SIZE - 8))
+
+uint8_t slot_valid(__xdata struct slot_header *h)
+{
+    __xdata uint8_t *p = (__xdata uint8_t *)h - (SLOT_SIZE - 8);
+    uint16_t n;
+
+    if (h->magic != SLOT_MAGIC || h->length > SLOT_SIZE - 8)
+        return 0;
+
+    // CRC16 in the random number generator, seeded with 0xFFFF
+    RNDL = 0xFF;
+    RNDL = 0xFF;
+    for (n = h->length; n > 0; n--)
+        RNDH = *p++;
+
+    return ((RNDH << 8) | RNDL) == h->crc;
+}
+
+void slot_copy(void)
+{
+    uint8_t pg;
+    uint16_t i;
+
+    // In page order, so slot A's header is only rewritten at the end and
+    // an interrupted copy leaves it invalid with slot B still intact
+    for (pg = 1; pg < 16; pg++)
+    {
+        WDCTL = (WDCTL & ~0xF0) | (0xA0);   // pat
+        WDCTL = (WDCTL & ~0xF0) | (0x50);
+
+        for (i = 0; i < 1024; i++)
+            rambuf[i] = flashp[((uint16_t)(pg + 15) << 10) + i];
+        flash_erase_page(pg);
+        flash_write(pg);
+    }
+}
+#endif
 
 void jump_to_user(void)
 {
+#ifdef DUAL_SLOT
+    // Serial number order, so that version 0 follows 0xFFFF
+    if (slot_valid(SLOT_B) && (!slot_valid(SLOT_A) || (int16_t)(SLOT_B->version - SLOT_A->version) > 0))
+        slot_copy();
+
+    // Images without a header are booted as before
+    if (SLOT_A->magic == SLOT_MAGIC && !slot_valid(SLOT_A))
+        return;
+#endif
+
     if (*((__xdata uint8_t*)0x400) != 0xFF)
     {
         // Disable all interrupts
@@ -231,9 +317,20 @@ void jump_to_user(void)
 }
 
 
+void jump_to_stage1(void)
+{
+    // Stage-1 runs from SRAM with interrupts off and the watchdog running
+    EA = 0;
+
+    __asm
+    ljmp #0xF000
+    __endasm;
+}
+
 void bootloader_main(void)
 {
     uint16_t i;
+    uint16_t sum;
     uint8_t n;
 
     // Initialise clocks
@@ -248,7 +345,9 @@ void bootloader_main(void)
 //    while (CLKCON & CLKCON_OSC);
 //    SLEEP |= SLEEP_OSC_PD;	// Disable RC oscillator now that we have an external crystal
 
+#ifndef APP_URX0
     rxfifo_in = rxfifo_out = 0;
+#endif
 
 	PERCFG = (PERCFG & ~PERCFG_U0CFG) | PERCFG_U1CFG;
 	P0SEL |= (1<<3) | (1<<2);
@@ -256,7 +355,9 @@ void bootloader_main(void)
 	U0BAUD = 34;    // 115200
 	U0GCR = 13; // 115k2 baud at 13MHz, useful for coming out of sleep.  Assumes clkspd_div2 in clkcon for HSRC osc
 	URX0IF = 0;	// No interrupts pending at start
+#ifndef APP_URX0
 	URX0IE = 1;	// Serial Rx irqs enabled in system interrupt register
+#endif
 
     F1 = 1;
     EA = 1;
@@ -265,6 +366,15 @@ void bootloader_main(void)
     while(n < sizeof(banner))
         cons_putc(banner[n++]);
 
+    if (boot_request == BOOT_REQUEST_MAGIC)
+    {
+        // Still send the Bs which cctl-prog is waiting for
+        boot_request = 0;
+        cons_putc('B');
+        cons_putc('B');
+        goto upgrade_loop;
+    }
+
     n = 8;
     i = 65535;
     while(!cons_getch() && n > 0)
@@ -295,13 +405,13 @@ upgrade_loop:
             {
                 case 'e':
                     while(!cons_getch());
-                    flash_erase_page();
+                    flash_erase_page(page);
                     goto ack;
                 break;
 
                 case 'p':
                     while(!cons_getch());
-                    flash_write();
+                    flash_write(page);
                     goto ack;
                 break;
 
@@ -327,6 +437,23 @@ upgrade_loop:
                     jump_to_user();
                 break;
 
+                case 'x':
+                    // Take the checksum first, the UART may be polled
+                    while(!cons_getch());
+                    sum = page;
+                    while(!cons_getch());
+                    sum |= page << 8;
+                    for (i=0;i<1024;i++)
+                        sum -= rambuf[i];
+                    if (sum != 0)
+                    {
+                        cons_putc(1);
+                        break;
+                    }
+                    cons_putc(0);
+                    jump_to_stage1();
+                break;
+
                 ack:
                     cons_putc(0);
 
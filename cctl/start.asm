@@ -1,3 +1,8 @@
+; APP_URX0 is 1 if the application owns URX0, its vector then jumps
+; straight to the application without testing PSW.F1 on every byte.
+; Set with make APP_URX0=1, which writes options.inc.
+	.include "options.inc"
+;
 	.globl __start__stack
 ;--------------------------------------------------------
 ; Stack segment in internal ram
@@ -18,7 +23,11 @@ __interrupt_vect:
 	.ds	5
 	ljmp #(0x400+0x0B)
 	.ds	5
+	.if APP_URX0
+	ljmp #(0x400+0x13)
+	.else
     ljmp uart0_isr_forward;
+	.endif
 	.ds	5
 	ljmp #(0x400+0x1B)
 	.ds	5
@@ -49,8 +58,21 @@ __interrupt_vect:
 	ljmp #(0x400+0x83)
 	.ds	5
 	ljmp #(0x400+0x8B)
-	.ds	5
+
+; Flash services for application code, see cctl.h. They take the place
+; of the padding after the last vector, so their addresses are fixed;
+; the Makefile checks them in the link map.
+	.globl _flash_erase_page
+	.globl _flash_write
+	.globl flash_erase_page_entry
+	.globl flash_write_entry
+flash_erase_page_entry:			; 0x008E
+	ljmp _flash_erase_page
+flash_write_entry:			; 0x0091
+	ljmp _flash_write
 	
+	.if APP_URX0
+	.else
 uart0_isr_forward:
 	push psw
     jnb psw.1, 00001$
@@ -59,6 +81,7 @@ uart0_isr_forward:
 00001$:
     pop psw
 	ljmp #(0x400+0x13)
+	.endif
 
 
 ;--------------------------------------------------------
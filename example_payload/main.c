@@ -1,4 +1,5 @@
 #include "cc1110.h"
+#include "cctl-app.h"
 
 #define nop()	__asm nop __endasm;
 
@@ -14,8 +15,20 @@ void delay (unsigned char n)
 			  nop();
 }
  
+// UART0 is left configured by the bootloader
+void uart0_isr(void) __interrupt URX0_VECTOR
+{
+    URX0IF = 0;
+    cctl_app_rx(U0DBUF);
+}
+
 void main(void)
 {  
+    // reset into the bootloader when cctl-prog sends +++
+    URX0IF = 0;
+    URX0IE = 1;
+    EA = 1;
+
     // toggle P2_3
     P2DIR |= (1<<3);
     P2_3 = 0;